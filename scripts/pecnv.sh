@@ -17,6 +17,7 @@ usage(){
     >&2 echo " -a/--alnmem = Memory to be use by bwa aln step.  Default = 5000000"
     >&2 echo " -b/--bamfilebase = Prefix for bam file.  Default = pecnv_bamfile"
     >&2 echo " -u/--ulimit = max RAM usage for processing BAM file.  Unit is in gigabytes, e.g., 5 will be converted to 5*1024^2 bytes"
+    >&2 echo " -M/--mergebam = Also merge the per-lane BAM files into one sorted, indexed BAM file, for use by pecnv teclust.  Default is not to merge."
     >&2 echo "Example:"
     >&2 echo "$0 -i readfile.txt -r reference.fa"
     exit 1
@@ -31,6 +32,7 @@ SORTMEM=50000000
 ALNMEM=5000000
 BAMFILESTUB="pecnv_bamfile"
 SAMPLEID=sample
+MERGEBAM=0
 
 while true; do
     case "$1" in
@@ -46,6 +48,7 @@ while true; do
 	-a | --alnmem ) ALNMEM="$2"; shift 2;;
 	-b | --bamfilebase ) BAMFILESTUB="$2" ; shift 2;;
 	-u | --ulimit ) MAXRAM=`echo "$2*1025^2"|bc -l` ; shift 2;;
+	-M | --mergebam ) MERGEBAM=1 ; shift;;
 	-- ) shift; break ;;
     * ) break ;;
   esac
@@ -59,7 +62,7 @@ if [ -z ${SAMPLES+x} ]; then >&2 echo "Error: no input file specified"; usage; e
 if [ -z ${REFERENCE+x} ]; then >&2 echo "Error: no reference file specified"; usage; else echo "Reference file name is set to '$REFERENCE'"; fi
 
 #Check for executable dependencies
-for needed in bwa samtools pecnv Rscript pecnv_insert_qtile
+for needed in bwa samtools pecnv
 do
     PM=`which $needed`
     if [ -z ${PM} ]
@@ -112,35 +115,57 @@ then
     exit
 fi
 
-if [ ! -e $OUTDIR/"$BAMFILESTUB"_sorted.bam ]
+NPAIRS=${#LEFTS[@]}
+SORTEDBAM="$OUTDIR/$BAMFILESTUB"_sorted.bam
+ALIGNED=0
+if [ -e $SORTEDBAM ] && [ ! -e "$OUTDIR/$BAMFILESTUB"_sorted.lane0.bam ]
 then
-    NPAIRS=${#LEFTS[@]}
+    echo $SORTEDBAM exists, so skipping alignment step
+    BAMFILES=$SORTEDBAM
+    if [ ! -e $SORTEDBAM.bai ]
+    then
+	samtools index $SORTEDBAM
+    fi
+else
+    BAMFILES=""
     PAIR=0
     while [ $PAIR -lt $NPAIRS ]
     do
 	LEFTREADS=${LEFTS[$PAIR]}
 	RIGHTREADS=${RIGHTS[$PAIR]}
-	BAMFILEBASE="$OUTDIR/intermediate_bamfile$PAIR"
+	BAMFILEBASE="$OUTDIR/$BAMFILESTUB"_sorted.lane$PAIR
 	if [ $NPAIRS -eq 1 ]
 	then
 	    BAMFILEBASE="$OUTDIR/$BAMFILESTUB"_sorted
 	fi
+	BAMFILES="$BAMFILES $BAMFILEBASE.bam"
+	if [ -e $BAMFILEBASE.bam ]
+	then
+	    echo $BAMFILEBASE.bam exists, so skipping alignment of $LEFTREADS and $RIGHTREADS
+	else
+	    ALIGNED=1
+	    rm -f $BAMFILEBASE.bam.bai
     #ALIGN THIS PAIR 
     #We go straight to sorted BAM output via process substitution
-	bwa sampe -a 5000 -N 5000 -n 500 $REFERENCE <(bwa aln -t $CPU $BWAEXTRAPARMS $REFERENCE $LEFTREADS 2> $OUTDIR/align_stderr_1.$PAIR) <(bwa aln -t $CPU $BWAEXTRAPARMS $REFERENCE $RIGHTREADS 2> $OUTDIR/align_stderr_1.$PAIR) $LEFTREADS $RIGHTREADS 2> $OUTDIR/sampe.$PAIR.stderr | samtools view -bS - 2> $OUTDIR/view.$PAIR.stderr | samtools sort -m $SORTMEM - $BAMFILEBASE 2> $OUTDIR/sort.$PAIR.stderr
+	    bwa sampe -a 5000 -N 5000 -n 500 $REFERENCE <(bwa aln -t $CPU $BWAEXTRAPARMS $REFERENCE $LEFTREADS 2> $OUTDIR/align_stderr_1.$PAIR) <(bwa aln -t $CPU $BWAEXTRAPARMS $REFERENCE $RIGHTREADS 2> $OUTDIR/align_stderr_1.$PAIR) $LEFTREADS $RIGHTREADS 2> $OUTDIR/sampe.$PAIR.stderr | samtools view -bS - 2> $OUTDIR/view.$PAIR.stderr | samtools sort -m $SORTMEM - $BAMFILEBASE 2> $OUTDIR/sort.$PAIR.stderr
+	fi
+	if [ ! -e $BAMFILEBASE.bam.bai ]
+	then
+	    samtools index $BAMFILEBASE.bam
+	fi
 	PAIR=$(($PAIR+1))
     done
-
-###2. Merge bam files if necessary
-    if [ $NPAIRS -gt 1 ]
+    #A merged file from an earlier run is out of date once a lane is realigned
+    if [ $NPAIRS -gt 1 ] && [ $ALIGNED -eq 1 ]
     then
-	samtools merge $OUTDIR/"$BAMFILESTUB"_sorted.bam $OUTDIR/intermediate_bamfile*.bam
-	rm -f $OUTDIR/intermediate_bamfile*.bam
+	rm -f $SORTEDBAM $SORTEDBAM.bai
     fi
-else
-    echo $OUTDIR/"$BAMFILESTUB"_sorted.bam exists, so skipping alignment step
 fi
 
+###2. There is no need to merge the per-lane BAM files:
+###   read pairs never span lanes, so process and mdist read them all, one lane per worker.
+###   If asked (-M), they are merged at the end for teclust.
+
 ###3. Collect unusual read pairings and estimate insert size distributions
 if [ -z ${MAXRAM+x} ]
 then
@@ -149,8 +174,21 @@ else
     ulimit -v $MM
 fi
 
-pecnv process -b $OUTDIR/"$BAMFILESTUB"_sorted.bam -s $OUTDIR/$BAMFILESTUB.cnv_mappings -u $OUTDIR/$BAMFILESTUB.um 
-pecnv mdist -b $OUTDIR/"$BAMFILESTUB"_sorted.bam -o $OUTDIR/$BAMFILESTUB.mdist.gz
+pecnv process -b $BAMFILES -s $OUTDIR/$BAMFILESTUB.cnv_mappings -u $OUTDIR/$BAMFILESTUB.um 
+pecnv mdist -b $BAMFILES -o $OUTDIR/$BAMFILESTUB.mdist.gz
 
-###4. Cluster (uses Rscript to get the 99.9th quantile of insert size distribution)
-pecnv cnvclust -s $SAMPLEID -m $MINQUAL -M $MISMATCHES -g $GAPS -d `pecnv_insert_qtile $OUTDIR/$BAMFILESTUB.mdist.gz 0.999` -D $OUTDIR/$BAMFILESTUB.div.gz  -P $OUTDIR/$BAMFILESTUB.par.gz  -U $OUTDIR/$BAMFILESTUB.ul.gz -i $OUTDIR/$BAMFILESTUB.cnv_mappings.csv.gz
+###4. Cluster (uses the 99.9th quantile of insert size distribution)
+pecnv cnvclust -s $SAMPLEID -m $MINQUAL -M $MISMATCHES -g $GAPS -d `pecnv qtile $OUTDIR/$BAMFILESTUB.mdist.gz 0.999` -D $OUTDIR/$BAMFILESTUB.div.gz  -P $OUTDIR/$BAMFILESTUB.par.gz  -U $OUTDIR/$BAMFILESTUB.ul.gz -i $OUTDIR/$BAMFILESTUB.cnv_mappings.csv.gz
+
+###5. Merge the per-lane BAM files for teclust, if asked.
+if [ $MERGEBAM -eq 1 ] && [ $NPAIRS -gt 1 ] && [ ! -e $SORTEDBAM ]
+then
+    if samtools merge $SORTEDBAM.tmp.bam $BAMFILES && mv $SORTEDBAM.tmp.bam $SORTEDBAM
+    then
+	samtools index $SORTEDBAM
+    else
+	rm -f $SORTEDBAM.tmp.bam
+	>&2 echo "Error: could not merge the per-lane BAM files into $SORTEDBAM"
+	exit 1
+    fi
+fi
@@ -0,0 +1,78 @@
+#include <bamregion.hpp>
+#include <htslib/sam.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+using namespace Sequence;
+
+bam_index::bam_index( const char * bamfilename ) : idx(hts_idx_load(bamfilename,HTS_FMT_BAI))
+{
+}
+
+bam_index::~bam_index()
+{
+  if( idx != NULL ) hts_idx_destroy(idx);
+}
+
+bam_index::operator bool() const
+{
+  return idx != NULL;
+}
+
+int64_t bam_index::offset( const int32_t & refid,
+			   const int32_t & beg,
+			   const int32_t & end ) const
+{
+  hts_itr_t * itr = sam_itr_queryi(idx,refid,beg,end);
+  if( itr == NULL ) return -1;
+  const int64_t rv = (itr->n_off > 0) ? int64_t(itr->off[0].u) : -1;
+  hts_itr_destroy(itr);
+  return rv;
+}
+
+int64_t bam_index::mapped( const int32_t & refid ) const
+{
+  uint64_t m = 0,u = 0;
+  if( hts_idx_get_stat(idx,refid,&m,&u) < 0 ) return -1;
+  return int64_t(m);
+}
+
+bool fetch_region( const bamreader & reader,
+		   const bam_index & index,
+		   const int32_t & refid,
+		   const int32_t & beg,
+		   const int32_t & end,
+		   const function<bool(bamrecord &)> & f )
+{
+  const int64_t offset = index.offset(refid,beg,end);
+  if( offset < 0 ) return true;
+  if( reader.seek(offset,SEEK_SET) < 0 )
+    {
+      cerr << "Error: could not seek to the reads on reference ID " << refid
+	   << " in the BAM file\n";
+      exit(1);
+    }
+  while( !reader.eof() && !reader.error() )
+    {
+      bamrecord b = reader.next_record();
+      if( b.empty() || b.refid() != refid || b.pos() >= end ) break;
+      if( b.pos() < beg ) continue;
+      if( !f(b) ) return false;
+    }
+  return true;
+}
+
+void merge_regions( bam_regions & r )
+{
+  sort(r.begin(),r.end());
+  bam_regions m;
+  for( const auto & i : r )
+    {
+      if( !m.empty() && i.first <= m.back().second ) m.back().second = max(m.back().second,i.second);
+      else m.push_back(i);
+    }
+  r.swap(m);
+}
@@ -0,0 +1,56 @@
+#ifndef __PECNV_BAMREGION_HPP__
+#define __PECNV_BAMREGION_HPP__
+
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+#include <Sequence/bamreader.hpp>
+#include <Sequence/bamrecord.hpp>
+#include <htslib/hts.h>
+
+/*
+  Region queries on sorted, indexed BAM files.  htslib's .bai index
+  gives the file offset of the first record that may overlap a region,
+  and a Sequence::bamreader is then moved there with seek().
+*/
+struct bam_index
+{
+  hts_idx_t * idx;
+  explicit bam_index( const char * bamfilename ); //idx is NULL if the file has no index
+  ~bam_index();
+  bam_index( const bam_index & ) = delete;
+  bam_index & operator=( const bam_index & ) = delete;
+  explicit operator bool() const;
+  //Virtual file offset of the first record that may overlap [beg,end) on refid, or -1 if there are none
+  std::int64_t offset( const std::int32_t & refid,
+		       const std::int32_t & beg,
+		       const std::int32_t & end ) const;
+  /*
+    Number of mapped reads on refid, according to the index, or -1 if
+    the index does not say.  A .bai written without metadata pseudo-bins
+    has no counts, and neither does a reference with no reads at all.
+  */
+  std::int64_t mapped( const std::int32_t & refid ) const;
+};
+
+/*
+  Calls f on each record on refid whose position is in [beg,end), in file order.
+  f returns false to stop early.  Returns false if f did so.
+  The reader is left positioned after the last record read.
+  A failed seek is an I/O error, and exits the program.
+*/
+bool fetch_region( const Sequence::bamreader & reader,
+		   const bam_index & index,
+		   const std::int32_t & refid,
+		   const std::int32_t & beg,
+		   const std::int32_t & end,
+		   const std::function<bool(Sequence::bamrecord &)> & f );
+
+//Regions [beg,end) on one reference
+using bam_regions = std::vector<std::pair<std::int32_t,std::int32_t> >;
+
+//Sort r, and merge regions that overlap or touch, so that each record is fetched once
+void merge_regions( bam_regions & r );
+
+#endif
@@ -1,17 +1,27 @@
 /*
   Estimates insert size distribution from "proper pairs"
-  in a BAM file
+  in one or more BAM files
 */
 
 #include <Sequence/bamreader.hpp>
 #include <Sequence/samflag.hpp>
-#include <map>
 #include <limits>
-#include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <random>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <string>
 #include <iostream>
+#include <cstdlib>
+#include <cctype>
 #include <boost/program_options.hpp>
-#include <common.hpp>
 #include <file_common.hpp>
+#include <isize_histogram.hpp>
+#include <bamregion.hpp>
 #include <zlib.h>
 
 
@@ -21,114 +31,352 @@ using namespace Sequence;
 
 struct mdist_opts
 {
-  string bamfilename,ofilename;
+  vector<string> bamfiles;
+  string ofilename;
   unsigned MAXPAIRS;
+  vector<double> quantiles;
+  unsigned nstable,tolerance,batchsize;
+  bool random;
+  int32_t window;
+  unsigned seed;
+  bool readgroups;
+  unsigned nthreads;
+};
+
+//Counts of read pairs, for the whole file or one shard of it
+struct mdist_counts
+{
+  isize_histogram all;
+  map<string,isize_histogram> byRG; //--readgroups: one histogram per RG tag
+  //Counts b if it is the leftmost read of a usable pair.  Returns true if so.
+  bool add( const bamrecord & b, const bool & readgroups );
+  void merge( const mdist_counts & rhs );
 };
 
 mdist_opts mdist_parse_argv(int argc, char ** argv);
 
-int bwa_mapdistance_main( int argc, char ** argv )
+/*
+  Each proper pair is counted once, from its leftmost read.
+  The pair must be on one chromosome, in forward/reverse orientation,
+  and the read must not be repetitive (XT:A:R).  If so, the distance is
+  abs(tlen), and the function returns true.
+*/
+bool mdist_pair_distance( const bamrecord & b, unsigned * distance )
 {
-  auto pars = mdist_parse_argv(argc, argv);
+  samflag sf = b.flag();
+  if( !sf.is_proper_pair ) return false;
+  if( b.refid() != b.next_refid() || b.pos() >= b.next_pos() ) return false;
+  if( sf.qstrand || !sf.mstrand ) return false;
+  bamaux a1 = b.aux("XT");
+  if( !a1.size || a1.value[0] == 'R' ) return false;
+  *distance = unsigned(abs(b.tlen()));
+  return true;
+}
 
-  bamreader reader(pars.bamfilename.c_str());
-  if( ! reader )
+bool mdist_counts::add( const bamrecord & b, const bool & readgroups )
+{
+  unsigned distance;
+  if( !mdist_pair_distance(b,&distance) ) return false;
+  all.add(distance);
+  if( readgroups )
     {
-      cerr << "Error: " << pars.bamfilename
-	   << " could not be opened for reading.\n";
-      exit(1);
+      bamaux rg = b.aux("RG");
+      if( rg.size ) byRG[string(rg.value)].add(distance);
     }
+  return true;
+}
 
-  map<unsigned,unsigned> mdist;
-  unordered_map<string,bamrecord> reads;
-  unsigned PAIRS_EVALUATED = 0;
-  while(!reader.eof()&&!reader.error())
+void mdist_counts::merge( const mdist_counts & rhs )
+{
+  all.merge(rhs.all);
+  for( const auto & rg : rhs.byRG )
+    {
+      auto itr = byRG.find(rg.first);
+      if( itr == byRG.end() ) byRG.insert(rg);
+      else itr->second.merge(rg.second);
+    }
+}
+
+/*
+  A unit of work: a region of one input file, or the
+  whole file if refid < 0
+*/
+struct mdist_shard
+{
+  size_t file;
+  int32_t refid,start,end;
+};
+
+/*
+  Readers and indexes for the input files, opened when first needed.
+  Each thread has its own.
+*/
+struct mdist_inputs
+{
+  const vector<string> & files;
+  vector<unique_ptr<bamreader> > readers;
+  vector<unique_ptr<bam_index> > indexes;
+  explicit mdist_inputs( const vector<string> & __files ) : files(__files),
+							   readers(__files.size()),
+							   indexes(__files.size())
+  {
+  }
+  const bamreader & reader( const size_t & i )
+  {
+    if( !readers[i] )
+      {
+	readers[i].reset(new bamreader(files[i].c_str()));
+	if( ! *readers[i] )
+	  {
+	    cerr << "Error: " << files[i]
+		 << " could not be opened for reading.\n";
+	    exit(1);
+	  }
+      }
+    return *readers[i];
+  }
+  const bam_index & index( const size_t & i )
+  {
+    if( !indexes[i] ) indexes[i].reset(new bam_index(files[i].c_str()));
+    return *indexes[i];
+  }
+  //Calls f on each record in s.  Returns false if f stopped early.
+  bool read( const mdist_shard & s, const function<bool(bamrecord &)> & f )
+  {
+    const bamreader & r = reader(s.file);
+    if( s.refid >= 0 ) return fetch_region(r,index(s.file),s.refid,s.start,s.end,f);
+    while(!r.eof()&&!r.error())
+      {
+	bamrecord b = r.next_record();
+	if(!b.empty() && !f(b)) return false;
+      }
+    return true;
+  }
+};
+
+//Each input file, from start to end
+vector<mdist_shard> whole_files( const mdist_opts & pars )
+{
+  vector<mdist_shard> shards;
+  for( size_t i = 0 ; i < pars.bamfiles.size() ; ++i ) shards.push_back(mdist_shard{i,-1,0,0});
+  return shards;
+}
+
+/*
+  Tiles of size bp covering every chromosome of every input file.
+  A file without an index is an error if require_index is true,
+  and is otherwise read whole, as a single shard.
+*/
+vector<mdist_shard> genome_windows( mdist_inputs & inputs,
+				    const int32_t & size,
+				    const bool & require_index,
+				    const char * option )
+{
+  vector<mdist_shard> windows;
+  for( size_t i = 0 ; i < inputs.files.size() ; ++i )
     {
-      bamrecord b = reader.next_record();
-      if(!b.empty())
+      if( !inputs.index(i) )
 	{
-	  samflag sf = b.flag();
-	  if( sf.is_proper_pair  )
+	  if( require_index )
 	    {
-	      bamaux a1 = b.aux("XT");
-	      if(a1.size)
-		{
-		  if (a1.value[0] != 'R')
-		    {
-		      string n = editRname(b.read_name());
-		      auto itr = reads.find(n);
-		      if( itr == reads.end() )
-			{
-			  reads.insert(make_pair(move(n),move(b)));
-			}
-		      else
-			{
-			  if( b.refid() == itr->second.refid() )
-			    {
-			      samflag sf2 = itr->second.flag();
-			      auto pos1 = b.pos(),pos2=itr->second.pos();
-			      if(( pos1 < pos2 && ( (!sf.qstrand && sf.mstrand)
-						    || ( sf2.qstrand && !sf2.mstrand) ) )
-				 ||
-				 ( ( pos2 < pos1 ) && ( (sf.qstrand && !sf.mstrand)
-							|| ( !sf2.qstrand && sf2.mstrand ) ) )
-				 )
-				{
-				  auto mitr = mdist.find(abs(b.tlen()));
-				  if( mitr == mdist.end() )
-				    {
-				      mdist.insert(make_pair(abs(b.tlen()),1));
-				    }
-				  else
-				    {
-				      mitr->second++;
-				      ++PAIRS_EVALUATED;
-				    }
-				}
-			    }
-			  reads.erase(itr);
-			}
-		    }
-		}
+	      cerr << "Error: " << option << " requires an index (.bai file) for "
+		   << inputs.files[i] << '\n';
+	      exit(1);
 	    }
+	  windows.push_back(mdist_shard{i,-1,0,0});
+	  continue;
 	}
-      if( pars.MAXPAIRS != numeric_limits<unsigned>::max() && PAIRS_EVALUATED >= pars.MAXPAIRS ) break;
+      const bamreader & reader = inputs.reader(i);
+      int32_t refid = 0;
+      for( auto r = reader.ref_cbegin() ; r != reader.ref_cend() ; ++r, ++refid )
+	{
+	  /*
+	    References with no mapped reads, e.g. many small unplaced contigs, would only add empty windows.
+	    Skip one only if the index says so: by its count of mapped reads or, without counts, by
+	    having no records on it at all.
+	  */
+	  const int64_t m = inputs.index(i).mapped(refid);
+	  if( m == 0 || ( m < 0 && inputs.index(i).offset(refid,0,r->second) < 0 ) ) continue;
+	  for( int32_t start = 0 ; start < r->second ; start += size )
+	    {
+	      windows.push_back(mdist_shard{i,refid,start,start+size});
+	    }
+	}
+    }
+  if( windows.empty() )
+    {
+      cerr << "Error: the indexes of the BAM files list no mapped reads, so there is nothing to read for "
+	   << option << '\n';
+      exit(1);
     }
+  return windows;
+}
 
-  unsigned sum = 0;
-  for( map<unsigned,unsigned>::const_iterator i = mdist.begin(); 
-       i != mdist.end() ; ++i )
+/*
+  Output file for a read group: the ID is added before the .gz extension.
+  Characters of the ID other than A-Z, a-z, 0-9, '.', '_', and '-' are
+  replaced by '_', so that the file is always next to ofilename.
+*/
+string readgroup_filename( const string & ofilename, const string & rg )
+{
+  string id(rg);
+  for( auto & c : id )
+    {
+      if( !isalnum((unsigned char)c) && c != '.' && c != '_' && c != '-' ) c = '_';
+    }
+  const string ext = ".gz";
+  if( ofilename.size() > ext.size() && ofilename.compare(ofilename.size()-ext.size(),ext.size(),ext) == 0 )
     {
-      sum += i->second;
+      return ofilename.substr(0,ofilename.size()-ext.size()) + '.' + id + ext;
     }
-  gzFile out = gzopen(pars.ofilename.c_str(),"w");
+  return ofilename + '.' + id;
+}
+
+void write_mdist( const string & ofilename, const isize_histogram & mdist )
+{
+  gzFile out = gzopen(ofilename.c_str(),"w");
   if(out==NULL)
     {
-      cerr << "Error: could not open " << pars.ofilename
+      cerr << "Error: could not open " << ofilename
 	   << " for writing.\n";
       exit(1);
     }
-  string header("distance\tnumber\tcprob\n");
-  if(!gzwrite(out,header.c_str(),header.size()))
+  if( mdist.write(out) <= 0 )
     {
       cerr << "Error: gzwrite error at line "
 	   << __LINE__ << " of " << __FILE__ << '\n';
       exit(1);
     }
-  unsigned cum=0;
-  for( map<unsigned,unsigned>::const_iterator i = mdist.begin(); 
-       i != mdist.end() ; ++i )
+  gzclose(out);
+}
+
+/*
+  Counts the shards with pars.nthreads threads.  Each thread has its own
+  readers, indexes, and counts, and takes shards until none are left.
+  The counts are summed at the end, so the result is the same as reading
+  the files from start to end.
+*/
+mdist_counts mdist_threaded( const vector<mdist_shard> & shards, const mdist_opts & pars )
+{
+  const unsigned nthreads = unsigned(min(size_t(pars.nthreads),shards.size()));
+  vector<mdist_counts> counts(max(1u,nthreads));
+  atomic<size_t> next(0);
+  auto worker = [&](const unsigned & t) {
+    mdist_inputs inputs(pars.bamfiles);
+    for( size_t i = next++ ; i < shards.size() ; i = next++ )
+      {
+	inputs.read(shards[i],[&](bamrecord & b) {
+	    counts[t].add(b,pars.readgroups);
+	    return true;
+	  });
+      }
+  };
+  vector<thread> threads;
+  for( unsigned t = 1 ; t < nthreads ; ++t ) threads.emplace_back(worker,t);
+  worker(0);
+  for( auto & t : threads ) t.join();
+  for( unsigned t = 1 ; t < nthreads ; ++t ) counts[0].merge(counts[t]);
+  return std::move(counts[0]);
+}
+
+int bwa_mapdistance_main( int argc, char ** argv )
+{
+  auto pars = mdist_parse_argv(argc, argv);
+
+  mdist_inputs inputs(pars.bamfiles);
+
+  mdist_counts counts;
+  quantile_convergence convergence(pars.quantiles.empty() ? vector<double>{0.99,0.999} : pars.quantiles,
+				   pars.tolerance,pars.nstable,pars.batchsize);
+  unsigned PAIRS_EVALUATED = 0;
+  //Returns false once no more pairs are needed
+  auto count = [&](const bamrecord & b) {
+    if( counts.add(b,pars.readgroups) )
+      {
+	++PAIRS_EVALUATED;
+	if( pars.nstable && convergence.done(counts.all) )
+	  {
+	    cerr << "quantiles converged after " << PAIRS_EVALUATED << " pairs\n";
+	    return false;
+	  }
+      }
+    return !( pars.MAXPAIRS != numeric_limits<unsigned>::max() && PAIRS_EVALUATED >= pars.MAXPAIRS );
+  };
+
+  vector<mdist_shard> shards;
+  if( pars.random )
+    {
+      /*
+	Visit the genome in windows of pars.window bp, in random order,
+	using the BAM index to seek to each one.  Windows are tiles, so each
+	read is seen at most once, and each chromosome is sampled in
+	proportion to its length.
+      */
+      shards = genome_windows(inputs,pars.window,true,"--random/-R");
+      shuffle(shards.begin(),shards.end(),mt19937_64(pars.seed));
+    }
+  else if( pars.nthreads > 1 )
+    {
+      //Large enough for the cost of a seek to not matter, small enough to balance the load
+      shards = genome_windows(inputs,5000000,false,"--threads/-t");
+    }
+  else
+    {
+      shards = whole_files(pars);
+    }
+
+  if( pars.nthreads > 1 )
+    {
+      counts = mdist_threaded(shards,pars);
+    }
+  else
     {
-      cum += i->second;
-      if( gzprintf(out,"%u\t%u\t%e\n",i->first,i->second,double(cum)/double(sum)) <= 0 )
+      for( const auto & s : shards )
 	{
-	  cerr << "Error: gzprintf error at line "
-	       << __LINE__ << " of " << __FILE__ << '\n';
+	  if( !inputs.read(s,count) ) break;
+	}
+    }
+
+  //Two read groups must not be written to the same file
+  map<string,string> rgfiles;
+  for( const auto & rg : counts.byRG )
+    {
+      const string fn = readgroup_filename(pars.ofilename,rg.first);
+      auto itr = rgfiles.find(fn);
+      if( itr != rgfiles.end() )
+	{
+	  cerr << "Error: read groups " << itr->second
+	       << " and " << rg.first << " would both be written to " << fn << '\n';
 	  exit(1);
 	}
+      rgfiles[fn] = rg.first;
     }
-  gzclose(out);
 
+  const isize_histogram & mdist = counts.all;
+  write_mdist(pars.ofilename,mdist);
+  for( const auto & rg : counts.byRG )
+    {
+      write_mdist(readgroup_filename(pars.ofilename,rg.first),rg.second);
+    }
+
+  if( !pars.quantiles.empty() )
+    {
+      if( !pars.readgroups )
+	{
+	  for( auto d : mdist.quantiles(pars.quantiles) ) cout << d << '\n';
+	}
+      else
+	{
+	  //One line per read group, following one for all reads
+	  auto print = [&pars](const string & label, const isize_histogram & h) {
+	    cout << label;
+	    for( auto d : h.quantiles(pars.quantiles) ) cout << '\t' << d;
+	    cout << '\n';
+	  };
+	  print("all",mdist);
+	  for( const auto & rg : counts.byRG ) print(rg.first,rg.second);
+	}
+    }
   return 0;
 }
 
@@ -138,9 +386,18 @@ mdist_opts mdist_parse_argv(int argc, char ** argv)
   options_description desc("pecnv mdist: estimate insert size distribution from BAM file");
   desc.add_options()
     ("help,h", "Produce help message")
-    ("bamfile,b",value<string>(&rv.bamfilename),"Input BAM file")
+    ("bamfile,b",value<vector<string> >(&rv.bamfiles)->multitoken(),"Input BAM file(s).  If more than one is given, e.g. one per lane, one distribution is estimated from all of them")
     ("outfile,o",value<string>(&rv.ofilename),"Output file name")
     ("mdist,m",value<unsigned>(&rv.MAXPAIRS)->default_value(numeric_limits<unsigned>::max()),"Max number of pairs to process. Default is \"unlimited.\"")
+    ("quantiles,q",value<string>(),"Comma-separated list of quantiles of the distribution to print to stdout, one per line, e.g. 0.99,0.999")
+    ("converge,c",value<unsigned>(&rv.nstable)->default_value(0),"Stop reading once the quantiles (--quantiles/-q, or 0.99 and 0.999 if not given) have moved by at most --tolerance for this many consecutive batches of --batchsize pairs.  Default (0) is to read the whole file")
+    ("tolerance",value<unsigned>(&rv.tolerance)->default_value(1),"Largest change in a quantile, in bp, between batches that counts as stable, for use with --converge/-c")
+    ("batchsize",value<unsigned>(&rv.batchsize)->default_value(100000),"Number of pairs between checks of the quantiles, for use with --converge/-c")
+    ("random,R","Instead of reading the BAM file from the start, visit windows of the genome in random order, using the BAM index (.bai).  Use with --mdist/-m and/or --converge/-c to stop once enough pairs have been sampled")
+    ("window,w",value<int32_t>(&rv.window)->default_value(10000),"Window size (bp) for --random/-R")
+    ("seed",value<unsigned>(&rv.seed)->default_value(0),"Random number seed for --random/-R")
+    ("threads,t",value<unsigned>(&rv.nthreads)->default_value(0),"Number of threads.  Each thread reads a different part of the genome, using the index (.bai) of each BAM file that has one, or else a different BAM file, and the output is the same as for one thread.  Default (0) is one per BAM file.  Cannot be combined with --mdist/-m, --converge/-c, or --random/-R, which read with one thread")
+    ("readgroups,g","Also write one distribution per read group (RG tag), to the output file name with the read group ID added before .gz.  Characters of the ID other than letters, digits, '.', '_', and '-' are replaced by '_'.  With --quantiles/-q, the quantiles are printed one line per read group, after a line labelled \"all\" for all reads")
     ;
 
 
@@ -156,13 +413,32 @@ mdist_opts mdist_parse_argv(int argc, char ** argv)
       cerr << desc << '\n';
       exit(0);
     }
-
-  if (!file_exists(rv.bamfilename.c_str()))
+  if( rv.batchsize == 0 ) rv.batchsize = 1;
+  rv.random = vm.count("random");
+  rv.readgroups = vm.count("readgroups");
+  const bool sampling = rv.random || rv.nstable || rv.MAXPAIRS != numeric_limits<unsigned>::max();
+  if( rv.nthreads > 1 && sampling )
+    {
+      cerr << "Error: --threads/-t cannot be combined with --mdist/-m, --converge/-c, or --random/-R\n";
+      exit(1);
+    }
+  if( rv.nthreads == 0 ) rv.nthreads = sampling ? 1 : unsigned(rv.bamfiles.size());
+  if( rv.window < 1 )
     {
-      cerr << "Error: input file "
-	   << rv.bamfilename
-	   << " does not exist\n";
+      cerr << "Error: --window/-w must be > 0\n";
       exit(1);
     }
+  if( vm.count("quantiles") ) rv.quantiles = parse_quantiles(vm["quantiles"].as<string>());
+
+  for( const auto & bamfile : rv.bamfiles )
+    {
+      if (!file_exists(bamfile.c_str()))
+	{
+	  cerr << "Error: input file "
+	       << bamfile
+	       << " does not exist\n";
+	  exit(1);
+	}
+    }
   return rv;
 }
@@ -0,0 +1,48 @@
+#include <chromdict.hpp>
+#include <algorithm>
+
+using namespace std;
+
+int32_t chromdict::id( const string & name )
+{
+  auto itr = ids.find(name);
+  if( itr != ids.end() ) return itr->second;
+  int32_t rv = int32_t(names.size());
+  ids.insert(make_pair(name,rv));
+  names.push_back(name);
+  return rv;
+}
+
+int32_t chromdict::find( const string & name ) const
+{
+  auto itr = ids.find(name);
+  return (itr == ids.end()) ? -1 : itr->second;
+}
+
+const string & chromdict::name( const int32_t & id ) const
+{
+  return names[id];
+}
+
+size_t chromdict::size() const
+{
+  return names.size();
+}
+
+vector<int32_t> chromdict::sorted_ids() const
+{
+  vector<int32_t> rv(names.size());
+  for(unsigned i = 0 ; i < rv.size() ; ++i ) rv[i]=int32_t(i);
+  sort(rv.begin(),rv.end(),[this](const int32_t & __l, const int32_t & __r) {
+      return names[__l] < names[__r];
+    });
+  return rv;
+}
+
+vector<int32_t> chromdict::ranks() const
+{
+  auto order = sorted_ids();
+  vector<int32_t> rv(order.size());
+  for(unsigned i = 0 ; i < order.size() ; ++i ) rv[order[i]] = int32_t(i);
+  return rv;
+}
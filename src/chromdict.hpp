@@ -0,0 +1,46 @@
+#ifndef __PECNV_CHROMDICT_HPP__
+#define __PECNV_CHROMDICT_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/*
+  Assigns dense integer ids to chromosome names, in order of first appearance.
+  Data binned by chromosome are stored in vectors indexed by these ids,
+  and output order is recovered via sorted_ids().
+*/
+struct chromdict
+{
+  std::unordered_map<std::string,std::int32_t> ids;
+  std::vector<std::string> names;
+  //Returns the id for name, assigning a new one if name has not been seen
+  std::int32_t id( const std::string & name );
+  //Returns the id for name, or -1 if name has not been seen
+  std::int32_t find( const std::string & name ) const;
+  const std::string & name( const std::int32_t & id ) const;
+  std::size_t size() const;
+  //All ids, ordered by chromosome name
+  std::vector<std::int32_t> sorted_ids() const;
+  //rank[id] = position of id in sorted_ids()
+  std::vector<std::int32_t> ranks() const;
+};
+
+//Key for data involving a pair of chromosomes, e.g. unlinked read pairs
+inline std::uint64_t pack_refids( const std::int32_t & id1, const std::int32_t & id2 )
+{
+  return (std::uint64_t(std::uint32_t(id1)) << 32) | std::uint64_t(std::uint32_t(id2));
+}
+
+inline std::int32_t packed_first( const std::uint64_t & key )
+{
+  return std::int32_t(key >> 32);
+}
+
+inline std::int32_t packed_second( const std::uint64_t & key )
+{
+  return std::int32_t(key & 0xFFFFFFFF);
+}
+
+#endif
@@ -22,6 +22,7 @@
 #include <string>
 #include <sstream>
 #include <map>
+#include <unordered_map>
 #include <cmath>
 #include <vector>
 #include <cassert>
@@ -29,74 +30,35 @@
 #include <functional>
 #include <iostream>
 #include <limits>
+#include <fstream>
 #include <zlib.h>
 #include <intermediateIO.hpp>
 #include <file_common.hpp>
+#include <chromdict.hpp>
+#include <cluster_cnv_objects.hpp>
+#include <cluster_cnv_extsort.hpp>
+#include <cluster_cnv_index.hpp>
+#include <cluster_cnv_sweep.hpp>
 #include <boost/program_options.hpp>
 
 
 using namespace std;
 using namespace boost::program_options;
 
-struct linkeddata
-{
-  mutable unsigned a,aS,b,bS; //positions on strands -- start1,stop1,start2,stop2
-  mutable string readname;
-  short strand1,strand2;
-  linkeddata(const unsigned & __a, 
-	     const unsigned & __aS, 
-	     const unsigned & __b,
-	     const unsigned & __bS,
-	     const string & __readname,
-	     const short & _strand1,
-	     const short & _strand2) : a(__a),
-				       aS(__aS),
-				       b(__b),
-				       bS(__bS),
-				       readname( __readname ),
-				       strand1(_strand1),strand2(_strand2)
-  {
-  }
-};
-
-auto order_clusters = []( const vector<vector<linkeddata>::const_iterator> & a,
-			  const vector<vector<linkeddata>::const_iterator> & b ) 
-{
-  unsigned min1 = numeric_limits<unsigned>::max(),
-  min2 = numeric_limits<unsigned>::max();
-  for(unsigned i=0;i<a.size();++i)
-    {
-      min1=min(min1,a[i]->a);
-    }
-  for(unsigned i=0;i<b.size();++i)
-    {
-      min2=min(min2,b[i]->a);
-    }
-  return min1 < min2;
-};
-
-using cluster_container = vector< vector<vector<linkeddata>::const_iterator> >;
-using lvector = vector<linkeddata>;
-using putCNVs = map<string,lvector>;
+using putCNVs = vector<lvector>;                  //indexed by chromdict id
+using putULs = unordered_map<uint64_t,lvector>;   //keyed by pack_refids(id1,id2)
 
 cluster_container cluster_linked( const lvector & raw,
 				  const unsigned & mdist );
 
-void reduce_clusters( cluster_container & clusters,
-		      const unsigned & mdist );
-
 unsigned mindist(const unsigned & st1,
 		 const unsigned & stp1,
 		 const unsigned & st2,
 		 const unsigned & stp2);
 
-bool pair_should_cluster( lvector::const_iterator & pair,
-			  vector<lvector::const_iterator> & cluster,
-			  const unsigned & mdist);
-
-bool unique_positions(const lvector & data,
-		      const unsigned & start,
-		      const unsigned & start2);
+bool pairs_link( const linkeddata & lhs,
+		 const linkeddata & rhs,
+		 const unsigned & mdist );
 
 /*
 //Old version, prior to bedpe output
@@ -113,36 +75,28 @@ void write_clusters_bedpe( gzFile o,
 			   const string & chrom1,
 			   const string & chrom2,
 			   const cluster_container & clusters,
-			   unsigned * eventid );
-
-void read_data(putCNVs & raw_div,
-	       putCNVs & raw_par,
-	       map<string,putCNVs > & raw_ul,
-	       const char * filename,
-	       const int8_t & min_mqual,
-	       const int16_t & max_mm,
-	       const int16_t & max_gap);
+			   unsigned * eventid,
+			   const vector<string> * samples );
 
-struct cluster_cnv_params
-{
-  string sampleID;
-  int8_t min_mqual;
-  int16_t max_mm,max_gap;
-  unsigned mdist;
-  string divfile,parfile,ulfile;
-  vector<string> infiles;
-};
+vector<string> read_manifest( const string & manifest,
+			      vector<vector<string> > * samplefiles );
 
 cluster_cnv_params clusterCNV_parseargs(int argc, char ** argv);
 
 int cluster_cnv_main(int argc, char ** argv)
 {
   auto pars = clusterCNV_parseargs(argc, argv);
+  if( pars.mquals.size()*pars.maxmms.size()*pars.maxgaps.size()*pars.mdists.size() > 1 )
+    {
+      cluster_cnv_sweep(pars);
+      return 0;
+    }
   gzFile divstream = gzopen(pars.divfile.c_str(),"wb");
   if(divstream==NULL) {
     cerr << "Error: could not open "
 	 << pars.divfile
 	 << " for writing\n";
+    exit(1);
   }
   gzFile parstream = gzopen(pars.parfile.c_str(),"wb");
   if(parstream == NULL) {
@@ -158,82 +112,80 @@ int cluster_cnv_main(int argc, char ** argv)
 	   << " for writing\n";
       exit(1);
     }
-  map<string, lvector > raw_div;
-  map<string, lvector > raw_par;
-  map<string, putCNVs > raw_ul;
 
-  for(unsigned i = 0 ; i < pars.infiles.size() ; ++i )
+  if( pars.update )
     {
-      read_data(raw_div,raw_par,raw_ul,
-		pars.infiles[i].c_str(),
-		pars.min_mqual,
-		pars.max_mm,
-		pars.max_gap);
+      cluster_cnv_update(pars,divstream,parstream,ulstream);
+      gzclose(parstream);
+      gzclose(ulstream);
+      gzclose(divstream);
+      return 0;
     }
 
-  unsigned eventid=0;
+  if( pars.runsize )
+    {
+      //External-memory mode
+      cluster_cnv_extsort(pars,divstream,parstream,ulstream);
+      gzclose(parstream);
+      gzclose(ulstream);
+      gzclose(divstream);
+      return 0;
+    }
+
+  putCNVs raw_div,raw_par;
+  putULs raw_ul;
+  chromdict chroms;
+
+  auto store = [&](const CNVTYPE & type, const uint64_t & key, linkeddata && d) {
+    if( type == CNV_UNL )
+      {
+	raw_ul[key].emplace_back(std::move(d));
+	return;
+      }
+    putCNVs & raw = (type == CNV_DIV) ? raw_div : raw_par;
+    const int32_t id = packed_first(key);
+    if( unsigned(id) >= raw.size() ) raw.resize(id+1);
+    raw[id].emplace_back(std::move(d));
+  };
+  read_all(pars,chroms,store);
+
+  //Output is ordered by chromosome name
+  const vector<int32_t> order = chroms.sorted_ids();
+  partition_writer writer(pars,divstream,parstream,ulstream);
   cerr << "clustering div\n";
-  for(putCNVs::iterator itr = raw_div.begin();
-      itr != raw_div.end();++itr)
-    {
-      sort(itr->second.begin(),
-	   itr->second.end(),
-	   [](const linkeddata & lhs, const linkeddata & rhs){
-	     return lhs.a < rhs.a && lhs.b < rhs.b;
-	   });
-      cluster_container clusters = cluster_linked(itr->second,pars.mdist);
-      cluster_container clusters2(clusters);
-      sort(clusters.begin(),clusters.end(),order_clusters);
-      write_clusters_bedpe( divstream, 
-			    pars.sampleID,
-			    string("div"),
-			    itr->first,itr->first,
-			    clusters,&eventid );
+  for( auto id : order )
+    {
+      if( unsigned(id) >= raw_div.size() || raw_div[id].empty() ) continue;
+      writer.submit( CNV_DIV, chroms.name(id), chroms.name(id), std::move(raw_div[id]) );
     }
 
   cerr << "clustering par\n";
-  eventid=0;
-  for(putCNVs::iterator itr = raw_par.begin();
-      itr != raw_par.end();++itr)
-    {
-      sort(itr->second.begin(),
-	   itr->second.end(),
-	   [](const linkeddata & lhs, const linkeddata & rhs){
-	     return lhs.a < rhs.a && lhs.b < rhs.b;
-	   });
-      cluster_container clusters = cluster_linked(itr->second,pars.mdist);
-      sort(clusters.begin(),clusters.end(),order_clusters);
-      write_clusters_bedpe( parstream, 
-			    pars.sampleID,
-			    string("par"),
-			    itr->first,
-			    itr->first,
-			    clusters,&eventid );
+  for( auto id : order )
+    {
+      if( unsigned(id) >= raw_par.size() || raw_par[id].empty() ) continue;
+      writer.submit( CNV_PAR, chroms.name(id), chroms.name(id), std::move(raw_par[id]) );
     }
 
   cerr << "clustering ul\n";
-  eventid=0;
-  for( map<string, putCNVs >::iterator itr = raw_ul.begin() ;
-       itr != raw_ul.end() ; ++itr )
+  //Order the chromosome pairs by (name1,name2)
+  const vector<int32_t> rank = chroms.ranks();
+  vector<uint64_t> ulkeys;
+  ulkeys.reserve(raw_ul.size());
+  for( auto itr = raw_ul.cbegin() ; itr != raw_ul.cend() ; ++itr ) ulkeys.push_back(itr->first);
+  sort(ulkeys.begin(),ulkeys.end(),[&rank](const uint64_t & lhs, const uint64_t & rhs) {
+      return make_pair(rank[packed_first(lhs)],rank[packed_second(lhs)]) <
+	make_pair(rank[packed_first(rhs)],rank[packed_second(rhs)]);
+    });
+  for( auto key : ulkeys )
     {
-      for( putCNVs::iterator itr2 = itr->second.begin() ; 
-	   itr2 != itr->second.end() ; ++itr2 )
-	{
-	  assert(itr->first < itr2->first);
-	  sort(itr2->second.begin(),itr2->second.end(),
-	       [](const linkeddata & lhs, const linkeddata & rhs){
-		 return lhs.a < rhs.a && lhs.b < rhs.b;
-	       });
-	  cluster_container clusters = cluster_linked(itr2->second,pars.mdist);
-	  sort(clusters.begin(),clusters.end(),order_clusters);
-	  write_clusters_bedpe( ulstream, 
-				pars.sampleID,
-				string("unl"),
-				itr->first,
-				itr2->first,
-				clusters,&eventid );
-	}
+      assert(chroms.name(packed_first(key)) < chroms.name(packed_second(key)));
+      writer.submit( CNV_UNL,
+		     chroms.name(packed_first(key)),
+		     chroms.name(packed_second(key)),
+		     std::move(raw_ul[key]) );
+      raw_ul.erase(key);
     }
+  writer.finish();
   gzclose(parstream);
   gzclose(ulstream);
   gzclose(divstream);
@@ -244,19 +196,25 @@ int cluster_cnv_main(int argc, char ** argv)
 cluster_cnv_params clusterCNV_parseargs(int argc, char ** argv)
 {
   cluster_cnv_params rv;
-  int mqual;
+  vector<int> mquals;
   options_description desc("pecnv cnvclust: cluster divergent, parallel, and unlinked read pairs into putative CNV calls");
   desc.add_options()
     ("help,h", "Produce help message")
     ("infiles,i",value<vector<string> >()->multitoken(),"Input files.  The input files are the output from the pecnv process subcommand")
-    ("maxdist,d",value<unsigned>(&rv.mdist),"Upper limit of insert size distribution")
+    ("joint,j",value<string>(),"Joint mode: cluster many samples together.  The argument is a file with one sample per line: a label for the sample, followed by its input files (the output from pecnv process), separated by whitespace.  Each event gets one extra column per sample, in the order of this file, with the number of read pairs from that sample supporting it.  Replaces --infiles/-i")
+    ("maxdist,d",value<vector<unsigned> >(&rv.mdists)->multitoken(),"Upper limit of insert size distribution")
     ("sample,s",value<string>(&rv.sampleID)->default_value("sample"),"Unique label/name for the sample")
-    ("mqual,m",value<int>(&mqual)->default_value(30),"Minimum mapping quality for a read to be included")
-    ("maxmm,M",value<int16_t>(&rv.max_mm)->default_value(3),"Max no. mismatches in a read for it to be included")
-    ("maxgap,g",value<int16_t>(&rv.max_gap)->default_value(0),"Max no. alignment gaps in a read for it to be included")
+    ("mqual,m",value<vector<int> >(&mquals)->multitoken()->default_value(vector<int>(1,30),"30"),"Minimum mapping quality for a read to be included")
+    ("maxmm,M",value<vector<int16_t> >(&rv.maxmms)->multitoken()->default_value(vector<int16_t>(1,3),"3"),"Max no. mismatches in a read for it to be included")
+    ("maxgap,g",value<vector<int16_t> >(&rv.maxgaps)->multitoken()->default_value(vector<int16_t>(1,0),"0"),"Max no. alignment gaps in a read for it to be included")
     ("divfile,D",value<string>(&rv.divfile)->default_value("div_clusters.gz"),"Output file for divergent clusters")
     ("parfile,P",value<string>(&rv.parfile)->default_value("par_clusters.gz"),"Output file for parallel clusters")
     ("unlfile,U",value<string>(&rv.ulfile)->default_value("unl_clusters.gz"),"Output file for unlinked clusters")
+    ("runsize,r",value<unsigned>(&rv.runsize)->default_value(0),"External-memory mode: sort the input into temporary runs of at most this many read pairs, then cluster one chromosome (or pair of chromosomes) at a time.  Peak RAM use is then bounded by the largest chromosome.  Default (0) is to hold all data in memory")
+    ("tmpdir,T",value<string>(&rv.tmpdir)->default_value("."),"Directory for temporary files when --runsize/-r is used")
+    ("threads,t",value<unsigned>(&rv.nthreads)->default_value(1),"Number of chromosomes (or pairs of chromosomes) to cluster concurrently")
+    ("index,x",value<string>(&rv.indexfile),"Also write the clusters to this index file, so that samples can be added later with --update")
+    ("update","Add the input samples (from --joint/-j, or --infiles/-i labelled by --sample/-s) to the clusters in the --index/-x file, instead of clustering from scratch.  Only clusters near the new read pairs are recomputed.  The index is rewritten, and the output files contain all samples.  --maxdist/-d must match the value used to make the index")
     ;
 
   variables_map vm;
@@ -266,26 +224,70 @@ cluster_cnv_params clusterCNV_parseargs(int argc, char ** argv)
 
   if( argc == 1 || 
       vm.count("help") ||
-      !vm.count("infiles") ||
+      (!vm.count("infiles") && !vm.count("joint")) ||
       !vm.count("mqual") ||
       !vm.count("maxdist") )
     {
       cerr << desc << '\n';
       exit(1);
     }
-  if(!vm.count("mqual"))
+  if( vm.count("infiles") && vm.count("joint") )
+    {
+      cerr << "Error: --infiles/-i and --joint/-j cannot be used together\n";
+      exit(1);
+    }
+  for( auto m : mquals ) rv.mquals.push_back(int8_t(m));
+  rv.min_mqual = rv.mquals[0];
+  rv.max_mm = rv.maxmms[0];
+  rv.max_gap = rv.maxgaps[0];
+  rv.mdist = rv.mdists[0];
+  if( rv.nthreads == 0 ) rv.nthreads = 1;
+  rv.update = vm.count("update");
+  if( rv.update && rv.indexfile.empty() )
+    {
+      cerr << "Error: --update requires --index/-x\n";
+      exit(1);
+    }
+  if( rv.update && !file_exists(rv.indexfile.c_str()) )
+    {
+      cerr << "Error: index file "
+	   << rv.indexfile
+	   << " does not exist\n";
+      exit(1);
+    }
+  if( rv.mquals.size()*rv.maxmms.size()*rv.maxgaps.size()*rv.mdists.size() > 1 &&
+      (rv.update || rv.runsize) )
     {
-      rv.min_mqual = int8_t(mqual);
+      cerr << "Error: a parameter sweep cannot be combined with --update or --runsize/-r\n";
+      exit(1);
     }
 
-  rv.infiles = vm["infiles"].as<vector<string> >();
+  vector<string> allfiles;
+  if( vm.count("joint") )
+    {
+      const string manifest = vm["joint"].as<string>();
+      if (!file_exists(manifest.c_str()))
+	{
+	  cerr << "Error: input file "
+	       << manifest
+	       << " does not exist\n";
+	  exit(1);
+	}
+      rv.samples = read_manifest(manifest,&rv.samplefiles);
+      for( const auto & f : rv.samplefiles ) allfiles.insert(allfiles.end(),f.begin(),f.end());
+    }
+  else
+    {
+      rv.infiles = vm["infiles"].as<vector<string> >();
+      allfiles = rv.infiles;
+    }
 
-  for(unsigned i = 0 ; i < rv.infiles.size() ; ++i )
+  for(unsigned i = 0 ; i < allfiles.size() ; ++i )
     {
-      if (!file_exists(rv.infiles[i].c_str()))
+      if (!file_exists(allfiles[i].c_str()))
 	{
 	  cerr << "Error: input file "
-	       << rv.infiles[i]
+	       << allfiles[i]
 	       << " does not exist\n";
 	  exit(1);
 	}
@@ -294,13 +296,46 @@ cluster_cnv_params clusterCNV_parseargs(int argc, char ** argv)
   return rv;
 }
 
-void read_data(putCNVs & raw_div,
-	       putCNVs & raw_par,
-	       map<string,putCNVs > & raw_ul,
-	       const char * filename,
-	       const int8_t & min_mqual,
-	       const int16_t & max_mm,
-	       const int16_t & max_gap)
+vector<string> read_manifest( const string & manifest,
+			      vector<vector<string> > * samplefiles )
+{
+  ifstream in(manifest.c_str());
+  if(!in)
+    {
+      cerr << "Error: could not open "
+	   << manifest
+	   << " for reading\n";
+      exit(1);
+    }
+  vector<string> rv;
+  string line;
+  while( getline(in,line) )
+    {
+      istringstream linestream(line);
+      string label,file;
+      if( !(linestream >> label) ) continue; //blank line
+      vector<string> files;
+      while( linestream >> file ) files.push_back(file);
+      if( files.empty() )
+	{
+	  cerr << "Error: no input files given for sample "
+	       << label << " in " << manifest << '\n';
+	  exit(1);
+	}
+      rv.push_back(label);
+      samplefiles->push_back(files);
+    }
+  if( rv.empty() )
+    {
+      cerr << "Error: no samples found in " << manifest << '\n';
+      exit(1);
+    }
+  return rv;
+}
+
+void read_data(const char * filename,
+	       chromdict & chroms,
+	       const pairdata_callback & f)
 {
   gzFile lin = gzopen(filename,"r");
   if(lin == NULL)
@@ -339,79 +374,222 @@ void read_data(putCNVs & raw_div,
 	  exit(1);
 	}
       alnInfo read1(lin),read2(lin);
-      if( read1.mapq >= min_mqual && read2.mapq >= min_mqual &&
-	  read1.mm <= max_mm && read1.ngap <= max_gap &&
-	  read2.mm <= max_mm && read2.ngap <= max_gap )
+      const pairquality q = { min(read1.mapq,read2.mapq),
+			      max(read1.mm,read2.mm),
+			      max(read1.ngap,read2.ngap) };
+      if(string(type) == "DIV")
 	{
-	  if(string(type) == "DIV")
-	    {
-	      if ( unique_positions(raw_div[chrom.first],
-				    (read1.strand==0) ? read2.start : read1.start,
-				    (read1.strand==0) ? read1.start : read2.start) )
-		{
-		  assert( (read1.strand==0) ? (read2.strand == 1) : (read1.strand == 1) );
-		  raw_div[chrom.first].push_back( linkeddata( (read1.strand==0) ? read2.start : read1.start,
-							      (read1.strand==0) ? read2.stop : read1.stop,
-							      (read1.strand==0) ? read1.start : read2.start,
-							      (read1.strand==0) ? read1.stop : read2.stop,
-							      name.first,1,0 ) );
-		}
-	    }
-	  else if (string(type) == "PAR")
-	    {
-	      if ( unique_positions(raw_par[chrom.first],
-				    (read1.start<read2.start) ? read1.start : read2.start,
-				    (read1.start<read2.start) ? read2.start : read1.start) )
-		{
-		  raw_par[chrom.first].push_back( linkeddata( (read1.start<read2.start) ? read1.start : read2.start,
-							      (read1.start<read2.start) ? read1.stop : read2.stop,
-							      (read1.start<read2.start) ? read2.start : read1.start,
-							      (read1.start<read2.start) ? read2.stop : read1.stop,
-							      name.first,
-							      (read1.start<read2.start) ? read1.strand : read2.strand,
-							      (read1.start<read2.start) ? read2.strand : read1.strand ));
-		}
-	    }
-	  else if (string(type) == "UNL")
+	  const int32_t id = chroms.id(chrom.first);
+	  assert( (read1.strand==0) ? (read2.strand == 1) : (read1.strand == 1) );
+	  f( CNV_DIV, pack_refids(id,id),
+	     linkeddata( (read1.strand==0) ? read2.start : read1.start,
+			 (read1.strand==0) ? read2.stop : read1.stop,
+			 (read1.strand==0) ? read1.start : read2.start,
+			 (read1.strand==0) ? read1.stop : read2.stop,
+			 name.first,1,0 ), q );
+	}
+      else if (string(type) == "PAR")
+	{
+	  const int32_t id = chroms.id(chrom.first);
+	  f( CNV_PAR, pack_refids(id,id),
+	     linkeddata( (read1.start<read2.start) ? read1.start : read2.start,
+			 (read1.start<read2.start) ? read1.stop : read2.stop,
+			 (read1.start<read2.start) ? read2.start : read1.start,
+			 (read1.start<read2.start) ? read2.stop : read1.stop,
+			 name.first,
+			 (read1.start<read2.start) ? read1.strand : read2.strand,
+			 (read1.start<read2.start) ? read2.strand : read1.strand ), q );
+	}
+      else if (string(type) == "UNL")
+	{
+	  assert(chrom.first != chrom2.first);
+	  if( chrom > chrom2 )
 	    {
-	      assert(chrom.first != chrom2.first);
-	      if( chrom > chrom2 )
-		{
-		  swap(chrom,chrom2);
-		  swap(read1,read2);
-		}
-	      if ( unique_positions(raw_ul[chrom.first][chrom2.first],read1.start,read2.start) )
-		{
-		  raw_ul[chrom.first][chrom2.first].push_back( linkeddata(read1.start,read1.stop,
-									  read2.start,read2.stop,
-									  name.first,
-									  read1.strand,read2.strand) );
-		}
+	      swap(chrom,chrom2);
+	      swap(read1,read2);
 	    }
+	  f( CNV_UNL, pack_refids(chroms.id(chrom.first),chroms.id(chrom2.first)),
+	     linkeddata(read1.start,read1.stop,
+			read2.start,read2.stop,
+			name.first,
+			read1.strand,read2.strand), q );
+	}
 #ifndef NDEBUG
-	  else
-	    {
-	      abort();
-	    }
-#endif
+      else
+	{
+	  abort();
 	}
+#endif
     } while(!gzeof(lin));
   gzclose(lin);
 }
 
-bool unique_positions(const lvector & data,
-		      const unsigned & start,
-		      const unsigned & start2)
+bool pairquality::passes( const int8_t & min_mqual,
+			  const int16_t & max_mm,
+			  const int16_t & max_gap ) const
+{
+  return mapq >= min_mqual && mm <= max_mm && ngap <= max_gap;
+}
+
+void read_all_unfiltered(const cluster_cnv_params & pars,
+			 chromdict & chroms,
+			 const pairdata_callback & f)
 {
-  for(unsigned i=0;i<data.size();++i)
+  if( pars.samples.empty() )
+    {
+      for(unsigned i = 0 ; i < pars.infiles.size() ; ++i )
+	{
+	  read_data(pars.infiles[i].c_str(),chroms,f);
+	}
+      return;
+    }
+  for(unsigned s = 0 ; s < pars.samples.size() ; ++s )
     {
-      if( start == data[i].a && 
-	  start2 == data[i].b )
+      cerr << "reading sample " << pars.samples[s] << '\n';
+      auto tag = [&f,s](const CNVTYPE & type, const uint64_t & key, linkeddata && d, const pairquality & q) {
+	d.sample = s;
+	f(type,key,std::move(d),q);
+      };
+      for(unsigned i = 0 ; i < pars.samplefiles[s].size() ; ++i )
 	{
-	  return false;
+	  read_data(pars.samplefiles[s][i].c_str(),chroms,tag);
 	}
     }
-  return true;
+}
+
+void read_all(const cluster_cnv_params & pars,
+	      chromdict & chroms,
+	      const linkeddata_callback & f)
+{
+  read_all_unfiltered(pars,chroms,
+		      [&](const CNVTYPE & type, const uint64_t & key, linkeddata && d, const pairquality & q) {
+			if( q.passes(pars.min_mqual,pars.max_mm,pars.max_gap) ) f(type,key,std::move(d));
+		      });
+}
+
+cluster_container cluster_partition( lvector & raw,
+				     const unsigned & mdist )
+{
+  //Stable, so that ties stay in input order and the first occurrence of a position is kept
+  stable_sort(raw.begin(),raw.end(),
+	      [](const linkeddata & lhs, const linkeddata & rhs){
+		if( lhs.a != rhs.a ) return lhs.a < rhs.a;
+		if( lhs.b != rhs.b ) return lhs.b < rhs.b;
+		return lhs.sample < rhs.sample;
+	      });
+  raw.erase( unique(raw.begin(),raw.end(),
+		    [](const linkeddata & lhs, const linkeddata & rhs){
+		      return lhs.a == rhs.a && lhs.b == rhs.b && lhs.sample == rhs.sample;
+		    }), raw.end() );
+  return cluster_linked(raw,mdist);
+}
+
+partition_writer::partition_writer( const cluster_cnv_params & __pars,
+				    gzFile divstream,
+				    gzFile parstream,
+				    gzFile ulstream ) : pars(__pars),
+							streams{divstream,parstream,ulstream},
+							index(NULL),
+							eventids{0,0,0},
+							pending()
+{
+  if( pars.indexfile.empty() ) return;
+  index = gzopen(pars.indexfile.c_str(),"wb");
+  if( index == NULL )
+    {
+      cerr << "Error: could not open "
+	   << pars.indexfile
+	   << " for writing\n";
+      exit(1);
+    }
+  cnvindex_header h(pars);
+  if( h.write(index) <= 0 )
+    {
+      cerr << "Error: could not write to "
+	   << pars.indexfile << '\n';
+      exit(1);
+    }
+}
+
+partition_writer::~partition_writer()
+{
+  finish();
+}
+
+void partition_writer::submit( const CNVTYPE & type,
+			       const string & chrom1,
+			       const string & chrom2,
+			       lvector && raw )
+{
+  unique_ptr<clustered_partition> p(new clustered_partition);
+  p->type = type;
+  p->chrom1 = chrom1;
+  p->chrom2 = chrom2;
+  p->raw = std::move(raw);
+  raw.clear();
+  if( pars.nthreads < 2 )
+    {
+      p->clusters = cluster_partition(p->raw,pars.mdist);
+      write(*p);
+      return;
+    }
+  while( pending.size() >= pars.nthreads )
+    {
+      write(*pending.front().get());
+      pending.pop_front();
+    }
+  const unsigned mdist = pars.mdist;
+  pending.emplace_back( async(launch::async,
+			      [mdist](unique_ptr<clustered_partition> __p) {
+				__p->clusters = cluster_partition(__p->raw,mdist);
+				return __p;
+			      },std::move(p)) );
+}
+
+void partition_writer::submit( unique_ptr<clustered_partition> && p )
+{
+  if( pars.nthreads < 2 )
+    {
+      write(*p);
+      return;
+    }
+  //Keep the output in order of submission
+  promise<unique_ptr<clustered_partition> > ready;
+  ready.set_value(std::move(p));
+  pending.emplace_back(ready.get_future());
+}
+
+void partition_writer::finish()
+{
+  while( !pending.empty() )
+    {
+      write(*pending.front().get());
+      pending.pop_front();
+    }
+  if( index != NULL )
+    {
+      gzclose(index);
+      index = NULL;
+    }
+}
+
+void partition_writer::write( const clustered_partition & p )
+{
+  static const char * labels[] = {"div","par","unl"};
+  write_clusters_bedpe( streams[p.type],
+			pars.sampleID,
+			string(labels[p.type]),
+			p.chrom1,
+			p.chrom2,
+			p.clusters,
+			&eventids[p.type],
+			pars.samples.empty() ? nullptr : &pars.samples );
+  if( index != NULL && cnvindex_partition(p).write(index) <= 0 )
+    {
+      cerr << "Error: could not write to "
+	   << pars.indexfile << '\n';
+      exit(1);
+    }
 }
 
 unsigned mindist(const unsigned & st1,
@@ -429,92 +607,117 @@ unsigned mindist(const unsigned & st1,
 
 
 
-bool pair_should_cluster( lvector::const_iterator & pair,
-			  vector<lvector::const_iterator> & cluster,
-			  const unsigned & mdist)
+bool pairs_link( const linkeddata & lhs,
+		 const linkeddata & rhs,
+		 const unsigned & mdist )
 {
-  for( unsigned i = 0 ; i < cluster.size() ; ++i )
+  if( lhs.strand1 == rhs.strand1
+      && lhs.strand2 == rhs.strand2 )
     {
-      if( pair->strand1 == cluster[i]->strand1
-	  && pair->strand2 == cluster[i]->strand2 )
-	{
-	  if( mindist(pair->a,pair->aS,cluster[i]->a,cluster[i]->aS) <= mdist &&
-	      mindist(pair->b,pair->bS,cluster[i]->b,cluster[i]->bS) <= mdist )
-	    {
-	      return true;
-	    }
-	}
-      else if(pair->strand1 == cluster[i]->strand2 &&
-	      pair->strand2 == cluster[i]->strand1)
-	{
-	  if( mindist(pair->a,pair->aS,cluster[i]->b,cluster[i]->bS) <= mdist &&
-	      mindist(pair->b,pair->bS,cluster[i]->a,cluster[i]->aS) <= mdist )
-	    {
-	      return true;
-	    }
-	}
+      return ( mindist(lhs.a,lhs.aS,rhs.a,rhs.aS) <= mdist &&
+	       mindist(lhs.b,lhs.bS,rhs.b,rhs.bS) <= mdist );
+    }
+  else if(lhs.strand1 == rhs.strand2 &&
+	  lhs.strand2 == rhs.strand1)
+    {
+      return ( mindist(lhs.a,lhs.aS,rhs.b,rhs.bS) <= mdist &&
+	       mindist(lhs.b,lhs.bS,rhs.a,rhs.aS) <= mdist );
     }
   return false;
 }
 
+/*
+  Clusters are the connected components of the graph in which
+  two read pairs are joined if pairs_link is true.
+
+  raw must be sorted by a.  No two reads further apart than the longest 
+  alignment plus mdist can link, so each pair is only compared to the 
+  preceding pairs within that window.  Pairs whose strands are swapped
+  relative to one another compare a to b, so those are found by a binary
+  search on the pairs sorted by b.  Components are tracked with union-find.
+
+  Clusters are returned in order of their first (leftmost) member,
+  with members in the order of raw.
+*/
 cluster_container cluster_linked( const lvector & raw,
 				  const unsigned & mdist )
 {
   using citr = lvector::const_iterator;
   cluster_container clusters;
+  const size_t n = raw.size();
+  if( !n ) return clusters;
+
+  vector<size_t> parent(n);
+  for( size_t i = 0 ; i < n ; ++i ) parent[i] = i;
+  auto root = [&parent](size_t i) {
+    while( parent[i] != i )
+      {
+	parent[i] = parent[parent[i]];
+	i = parent[i];
+      }
+    return i;
+  };
+  auto join = [&](const size_t & i, const size_t & j) {
+    size_t ri = root(i), rj = root(j);
+    if( ri != rj ) parent[max(ri,rj)] = min(ri,rj);
+  };
+
+  unsigned span = 0;
+  for( const auto & d : raw )
+    {
+      span = max(span,max(d.a,d.aS)-min(d.a,d.aS));
+      span = max(span,max(d.b,d.bS)-min(d.b,d.bS));
+    }
+  const uint64_t window = uint64_t(span) + mdist;
 
-  clusters.push_back( vector<citr>(1,raw.begin()) );
-  for( citr i = raw.begin()+1; i < raw.end();++i )
+  //Sweep over a
+  for( size_t i = 1 ; i < n ; ++i )
     {
-      bool clustered=false;
-      for(unsigned j=0;j<clusters.size();++j)
+      assert( raw[i-1].a <= raw[i].a );
+      for( size_t j = i ; j-- > 0 && uint64_t(raw[i].a - raw[j].a) <= window ; )
 	{
-	  if( pair_should_cluster(i,clusters[j],mdist) )
-	    {
-	      clusters[j].push_back(i);
-	      clustered=true;
-	      j=clusters.size();
-	    } 
-	}
-      if(!clustered)
-	{
-	  clusters.push_back( vector<citr>(1,i) );
+	  if( root(i) != root(j) && pairs_link(raw[i],raw[j],mdist) ) join(i,j);
 	}
     }
-  reduce_clusters(clusters,mdist);
-  return clusters;
-}
 
-void reduce_clusters( cluster_container & clusters,
-		      const unsigned & mdist )
-{
-  typedef cluster_container::iterator citr;
-  citr i=clusters.end()-1,j,beg=clusters.begin();
-  while( i>beg )
+  //Pairs with swapped strands: a of one near b of the other
+  vector<size_t> byb;
+  for( size_t i = 0 ; i < n ; ++i )
     {
-      bool merged = false;
-      for( j = i - 1 ; !merged&&j >= beg ; --j )
+      if( raw[i].strand1 != raw[i].strand2 ) byb.push_back(i);
+    }
+  if( !byb.empty() )
+    {
+      sort(byb.begin(),byb.end(),[&raw](const size_t & lhs, const size_t & rhs) {
+	  return raw[lhs].b < raw[rhs].b;
+	});
+      for( auto i : byb )
 	{
-	  //do any reads in i cluster with any data in j?
-	  for(unsigned k=0 ; !merged && k < i->size() ; ++k )
+	  const uint64_t lo = (raw[i].a > window) ? raw[i].a - window : 0,
+	    hi = uint64_t(raw[i].a) + window;
+	  auto j = lower_bound(byb.cbegin(),byb.cend(),lo,[&raw](const size_t & __j, const uint64_t & __v) {
+	      return raw[__j].b < __v;
+	    });
+	  for( ; j != byb.cend() && raw[*j].b <= hi ; ++j )
 	    {
-	      if( pair_should_cluster(*(i->begin()+k),*j,mdist ) )
-		{
-		  //answer is yes, so we merge i into j, 
-		  //delete i, and take care of iterator invalidation
-		  copy( i->begin(),i->end(),std::back_inserter(*j) );
-		  clusters.erase(i);
-		  i=clusters.end()-1;
-		  beg=clusters.begin();
-		  merged=true;
-		}
+	      if( raw[*j].strand1 == raw[i].strand2 && raw[*j].strand2 == raw[i].strand1 &&
+		  root(i) != root(*j) && pairs_link(raw[i],raw[*j],mdist) ) join(i,*j);
 	    }
 	}
-      if(!merged)
+    }
+
+  vector<size_t> index(n,n);
+  for( size_t i = 0 ; i < n ; ++i )
+    {
+      size_t r = root(i);
+      if( index[r] == n )
 	{
-	  --i;
+	  index[r] = clusters.size();
+	  clusters.push_back( vector<citr>() );
 	}
+      clusters[index[r]].push_back(raw.begin()+i);
     }
+  return clusters;
 }
 
 /*
@@ -583,13 +786,16 @@ void write_clusters_bedpe( gzFile gzout,
 			   const string & chrom1,
 			   const string & chrom2,
 			   const cluster_container & clusters,
-			   unsigned * eventid )
+			   unsigned * eventid,
+			   const vector<string> * samples )
 {
+  vector<unsigned> counts( samples ? samples->size() : 0 );
   for(unsigned i=0;i<clusters.size();++i)
     {
       //get the boundaries of each event
       unsigned min1=numeric_limits<unsigned>::max(),max1=0,min2=numeric_limits<unsigned>::max(),max2=0;
       string readnames;
+      fill(counts.begin(),counts.end(),0);
       for(unsigned j=0;j<clusters[i].size();++j)
 	{
 	  //The +1 here convert genomic positions to a [1,L] coordinate system
@@ -606,15 +812,18 @@ void write_clusters_bedpe( gzFile gzout,
 	    << clusters[i][j]->b+1 << ',' 
 	    << clusters[i][j]->bS+1 << ','
 	    << clusters[i][j]->strand2;
-	  if ( readnames.empty() )
+	  if ( !readnames.empty() )
 	    {
-	      readnames += clusters[i][j]->readname;
+	      readnames += "|";
 	    }
-	  else
+	  if( samples )
 	    {
-	      readnames += "|";
-	      readnames += clusters[i][j]->readname;
+	      //joint mode: label the read with its sample
+	      ++counts[clusters[i][j]->sample];
+	      readnames += (*samples)[clusters[i][j]->sample];
+	      readnames += ':';
 	    }
+	  readnames += clusters[i][j]->readname;
 	  readnames += t.str();
 	}
       ostringstream o;
@@ -629,7 +838,9 @@ void write_clusters_bedpe( gzFile gzout,
 	<< log10(clusters[i].size()) << '\t'                            //The score = log10(coverage)
 	<< ( (clusters[i][0]->strand1 == 0 ) ? '+' : '-' ) << '\t'      //strand1
 	<< ( (clusters[i][0]->strand2 == 0 ) ? '+' : '-' ) << '\t'      //strand2
-	<< readnames <<'\n';                                            //The reads are the optional column
+	<< readnames;                                                   //The reads are the optional column
+      for( auto c : counts ) o << '\t' << c;                            //Joint mode: support per sample
+      o << '\n';
       if(!gzwrite(gzout,o.str().c_str(),o.str().size()))
 	{
 	  cerr << "Error: gzwrite error encountered at line " << __LINE__ 
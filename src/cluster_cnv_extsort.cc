@@ -0,0 +1,312 @@
+#include <cluster_cnv_extsort.hpp>
+#include <intermediateIO.hpp>
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+  Temporary runs that exist on disk.  They are removed when merging is done,
+  or by remove_runs() if the program exits on an error first.
+  Only the main thread adds or removes names.
+*/
+static vector<string> live_runs;
+
+static void remove_runs()
+{
+  for( const auto & fn : live_runs ) remove(fn.c_str());
+  live_runs.clear();
+}
+
+struct extrecord
+{
+  int8_t type; //a CNVTYPE, or -1 if a read failed
+  uint64_t key,seq; //chromosome[-pair], and order in the input
+  linkeddata d;
+  extrecord( const CNVTYPE & __type,
+	     const uint64_t & __key,
+	     const uint64_t & __seq,
+	     linkeddata && __d ) : type(int8_t(__type)),key(__key),seq(__seq),d(std::move(__d))
+  {
+  }
+  /*
+    Construct via input from a temporary run, fn.  At the end of the run, type is -1.
+    Exits with an error if the run ends within a record, so that a truncated run is not taken as complete.
+  */
+  extrecord( gzFile in, const string & fn );
+  int write( gzFile out ) const;
+};
+
+extrecord::extrecord( gzFile in, const string & fn ) : type(-1),key(0),seq(0),d(0,0,0,0,string(),0,0)
+{
+  auto truncated = [&fn]() {
+    cerr << "Error: temporary file " << fn
+	 << " is truncated or could not be read\n";
+    exit(1);
+  };
+  auto get = [&](void * x, const unsigned & size) {
+    if( gzread(in,x,size) != int(size) ) truncated();
+  };
+  int8_t t;
+  const int rv = gzread(in,&t,sizeof(int8_t));
+  int err = Z_OK;
+  if( rv == 0 ) gzerror(in,&err);
+  if( rv < 0 || err != Z_OK ) truncated();
+  if( rv == 0 ) return; //end of the run
+  get(&key,sizeof(uint64_t));
+  get(&seq,sizeof(uint64_t));
+  get(&d.a,sizeof(unsigned));
+  get(&d.aS,sizeof(unsigned));
+  get(&d.b,sizeof(unsigned));
+  get(&d.bS,sizeof(unsigned));
+  get(&d.strand1,sizeof(short));
+  get(&d.strand2,sizeof(short));
+  get(&d.sample,sizeof(unsigned));
+  auto name = gzreadCstr(in);
+  if( name.second < 0 ) truncated();
+  d.readname = std::move(name.first);
+  type = t;
+}
+
+int extrecord::write( gzFile out ) const
+{
+  if( gzwrite(out,&type,sizeof(int8_t)) <= 0 ) return -1;
+  if( gzwrite(out,&key,sizeof(uint64_t)) <= 0 ) return -1;
+  if( gzwrite(out,&seq,sizeof(uint64_t)) <= 0 ) return -1;
+  if( gzwrite(out,&d.a,sizeof(unsigned)) <= 0 ) return -1;
+  if( gzwrite(out,&d.aS,sizeof(unsigned)) <= 0 ) return -1;
+  if( gzwrite(out,&d.b,sizeof(unsigned)) <= 0 ) return -1;
+  if( gzwrite(out,&d.bS,sizeof(unsigned)) <= 0 ) return -1;
+  if( gzwrite(out,&d.strand1,sizeof(short)) <= 0 ) return -1;
+  if( gzwrite(out,&d.strand2,sizeof(short)) <= 0 ) return -1;
+  if( gzwrite(out,&d.sample,sizeof(unsigned)) <= 0 ) return -1;
+  return gzwriteCstr(out,d.readname);
+}
+
+/*
+  Order of records in runs and in the merge.  Chromosome[-pair]s are compared
+  by the rank of their names, so that output is ordered by name.  Ranks computed
+  when a run is written remain valid later, because adding names to the
+  dictionary never changes the relative order of the names already in it.
+*/
+bool extrecord_less( const extrecord & lhs, const extrecord & rhs,
+		     const vector<int32_t> & rank )
+{
+  if( lhs.type != rhs.type ) return lhs.type < rhs.type;
+  if( lhs.key != rhs.key )
+    {
+      return make_pair(rank[packed_first(lhs.key)],rank[packed_second(lhs.key)]) <
+	make_pair(rank[packed_first(rhs.key)],rank[packed_second(rhs.key)]);
+    }
+  if( lhs.d.a != rhs.d.a ) return lhs.d.a < rhs.d.a;
+  if( lhs.d.b != rhs.d.b ) return lhs.d.b < rhs.d.b;
+  return lhs.seq < rhs.seq;
+}
+
+/*
+  The most runs merged at once.  Each open run is a file descriptor and a
+  zlib buffer, so with more runs than this, groups of runs are first merged
+  into longer runs.
+*/
+static const unsigned max_fanin = 64;
+
+//Create a temporary file, open it for writing, and set fn to its name
+gzFile open_run( const string & tmpdir, string * fn )
+{
+  string name = tmpdir + "/pecnv_cnvclust.XXXXXX";
+  vector<char> temp(name.begin(),name.end());
+  temp.push_back('\0');
+  int fd = mkstemp(temp.data());
+  if( fd == -1 )
+    {
+      cerr << "Error: could not create temporary file in "
+	   << tmpdir << " at line " << __LINE__
+	   << " of " << __FILE__ << '\n';
+      exit(1);
+    }
+  static bool registered = false;
+  if( !registered ) registered = (atexit(remove_runs) == 0);
+  *fn = string(temp.data());
+  live_runs.push_back(*fn);
+  gzFile o = gzdopen(fd,"wb1");
+  if( o == NULL )
+    {
+      cerr << "Error: could not open temporary file "
+	   << *fn << " for writing\n";
+      exit(1);
+    }
+  return o;
+}
+
+void write_record( gzFile o, const extrecord & r )
+{
+  if( r.write(o) <= 0 )
+    {
+      cerr << "Error: gzwrite error encountered at line " << __LINE__
+	   << " of " << __FILE__ << '\n';
+      exit(1);
+    }
+}
+
+void close_run( gzFile o, const string & fn )
+{
+  if( gzclose(o) != Z_OK )
+    {
+      cerr << "Error: could not write temporary file "
+	   << fn << '\n';
+      exit(1);
+    }
+}
+
+//Remove a run that has been merged
+void remove_run( const string & fn )
+{
+  remove(fn.c_str());
+  live_runs.erase(find(live_runs.begin(),live_runs.end(),fn));
+}
+
+//Sort buffer, write it to a new temporary file, and return the file name
+string write_run( vector<extrecord> & buffer,
+		  const chromdict & chroms,
+		  const string & tmpdir )
+{
+  const vector<int32_t> rank = chroms.ranks();
+  sort(buffer.begin(),buffer.end(),[&rank](const extrecord & lhs, const extrecord & rhs) {
+      return extrecord_less(lhs,rhs,rank);
+    });
+  string fn;
+  gzFile o = open_run(tmpdir,&fn);
+  for( const auto & r : buffer ) write_record(o,r);
+  close_run(o,fn);
+  buffer.clear();
+  return fn;
+}
+
+//k-way merge of runs, passing each record to f in order.  The runs are removed afterwards.
+void merge_runs( const vector<string> & runs,
+		 const vector<int32_t> & rank,
+		 const function<void(extrecord &&)> & f )
+{
+  using mentry = pair<extrecord,unsigned>; //record, run
+  auto greater = [&rank](const mentry & lhs, const mentry & rhs) {
+    return extrecord_less(rhs.first,lhs.first,rank);
+  };
+  priority_queue<mentry,vector<mentry>,decltype(greater)> heap(greater);
+  vector<gzFile> ins;
+  for( unsigned i = 0 ; i < runs.size() ; ++i )
+    {
+      gzFile in = gzopen(runs[i].c_str(),"rb");
+      if( in == NULL )
+	{
+	  cerr << "Error: could not open temporary file "
+	       << runs[i] << " for reading\n";
+	  exit(1);
+	}
+      ins.push_back(in);
+      extrecord r(in,runs[i]);
+      if( r.type != -1 ) heap.push(make_pair(std::move(r),i));
+    }
+  while( !heap.empty() )
+    {
+      mentry top = heap.top();
+      heap.pop();
+      extrecord next(ins[top.second],runs[top.second]);
+      if( next.type != -1 ) heap.push(make_pair(std::move(next),top.second));
+      f(std::move(top.first));
+    }
+  for( auto & in : ins ) gzclose(in);
+  for( const auto & fn : runs ) remove_run(fn);
+}
+
+void cluster_cnv_extsort( const cluster_cnv_params & pars,
+			  gzFile divstream,
+			  gzFile parstream,
+			  gzFile ulstream )
+{
+  chromdict chroms;
+  vector<extrecord> buffer;
+  vector<string> runs;
+  uint64_t seq = 0;
+
+  auto store = [&](const CNVTYPE & type, const uint64_t & key, linkeddata && d) {
+    buffer.emplace_back(type,key,seq++,std::move(d));
+    if( buffer.size() >= pars.runsize )
+      {
+	runs.push_back( write_run(buffer,chroms,pars.tmpdir) );
+      }
+  };
+  read_all(pars,chroms,store);
+
+  //Stream the sorted records, clustering each chromosome[-pair] once it is complete
+  partition_writer writer(pars,divstream,parstream,ulstream);
+  static const char * labels[] = {"div","par","ul"};
+  //Every type is announced, in order, even if it has no records, as in the in-memory mode
+  int8_t announced = -1;
+  auto announce = [&](const int8_t & type) {
+    while( announced < type ) cerr << "clustering " << labels[++announced] << '\n';
+  };
+  int8_t ptype = -1;
+  uint64_t pkey = 0;
+  lvector partition;
+  auto flush = [&]() {
+    if( partition.empty() ) return;
+    writer.submit( CNVTYPE(ptype),
+		   chroms.name(packed_first(pkey)),
+		   chroms.name(packed_second(pkey)),
+		   std::move(partition) );
+    partition.clear();
+  };
+  auto consume = [&](extrecord && r) {
+    if( r.type != ptype || r.key != pkey )
+      {
+	flush();
+	announce(r.type);
+	ptype = r.type;
+	pkey = r.key;
+      }
+    partition.emplace_back(std::move(r.d));
+  };
+
+  if( runs.empty() )
+    {
+      //Everything fit in one run, so skip the temporary files
+      const vector<int32_t> rank = chroms.ranks();
+      sort(buffer.begin(),buffer.end(),[&rank](const extrecord & lhs, const extrecord & rhs) {
+	  return extrecord_less(lhs,rhs,rank);
+	});
+      for( auto & r : buffer ) consume(std::move(r));
+      vector<extrecord>().swap(buffer);
+    }
+  else
+    {
+      if( !buffer.empty() ) runs.push_back( write_run(buffer,chroms,pars.tmpdir) );
+      vector<extrecord>().swap(buffer);
+      cerr << "merging " << runs.size() << " temporary runs\n";
+
+      const vector<int32_t> rank = chroms.ranks();
+      //Merge groups of runs until few enough are left to merge at once
+      while( runs.size() > max_fanin )
+	{
+	  vector<string> merged;
+	  for( size_t i = 0 ; i < runs.size() ; i += max_fanin )
+	    {
+	      const vector<string> group(runs.begin()+i,runs.begin()+min(runs.size(),i+max_fanin));
+	      string fn;
+	      gzFile o = open_run(pars.tmpdir,&fn);
+	      merge_runs(group,rank,[o](extrecord && r) { write_record(o,r); });
+	      close_run(o,fn);
+	      merged.push_back(fn);
+	    }
+	  runs.swap(merged);
+	}
+      merge_runs(runs,rank,consume);
+    }
+  flush();
+  announce(CNV_UNL);
+  writer.finish();
+}
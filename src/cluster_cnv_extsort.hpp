@@ -0,0 +1,17 @@
+#ifndef __PECNV_CLUSTER_CNV_EXTSORT_HPP__
+#define __PECNV_CLUSTER_CNV_EXTSORT_HPP__
+
+#include <cluster_cnv_objects.hpp>
+
+/*
+  External-memory cnvclust.  Filtered read pairs are sorted into temporary
+  runs of at most pars.runsize records, ordered by (type, chromosome[-pair], a, b).
+  The runs are then merged, and each chromosome[-pair] is clustered and written
+  as soon as all of its data have been seen.
+*/
+void cluster_cnv_extsort( const cluster_cnv_params & pars,
+			  gzFile divstream,
+			  gzFile parstream,
+			  gzFile ulstream );
+
+#endif
@@ -0,0 +1,450 @@
+#include <cluster_cnv_index.hpp>
+#include <intermediateIO.hpp>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <tuple>
+#include <limits>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+namespace
+{
+  const string magic = "pecnv_cnvindex";
+  const uint32_t version = 1;
+
+  //true if all of x was read.  A short read is a truncated file.
+  template<typename T>
+  bool read_field( gzFile in, T & x )
+  {
+    return gzread(in,&x,sizeof(T)) == int(sizeof(T));
+  }
+
+  //The order of read pairs within a cluster, and of clusters by their first member
+  bool member_less( const linkeddata & lhs, const linkeddata & rhs )
+  {
+    if( lhs.a != rhs.a ) return lhs.a < rhs.a;
+    if( lhs.b != rhs.b ) return lhs.b < rhs.b;
+    return lhs.sample < rhs.sample;
+  }
+
+  int write_member( gzFile out, const linkeddata & d )
+  {
+    if( gzwrite(out,&d.a,sizeof(unsigned)) <= 0 ) return -1;
+    if( gzwrite(out,&d.aS,sizeof(unsigned)) <= 0 ) return -1;
+    if( gzwrite(out,&d.b,sizeof(unsigned)) <= 0 ) return -1;
+    if( gzwrite(out,&d.bS,sizeof(unsigned)) <= 0 ) return -1;
+    if( gzwrite(out,&d.strand1,sizeof(short)) <= 0 ) return -1;
+    if( gzwrite(out,&d.strand2,sizeof(short)) <= 0 ) return -1;
+    if( gzwrite(out,&d.sample,sizeof(unsigned)) <= 0 ) return -1;
+    return gzwriteCstr(out,d.readname);
+  }
+
+  bool read_member( gzFile in, linkeddata & d )
+  {
+    if( !read_field(in,d.a) ) return false;
+    if( !read_field(in,d.aS) ) return false;
+    if( !read_field(in,d.b) ) return false;
+    if( !read_field(in,d.bS) ) return false;
+    if( !read_field(in,d.strand1) ) return false;
+    if( !read_field(in,d.strand2) ) return false;
+    if( !read_field(in,d.sample) ) return false;
+    auto name = gzreadCstr(in);
+    if( name.second <= 0 ) return false;
+    d.readname = std::move(name.first);
+    return true;
+  }
+
+  //Lay out clusters of read pairs as a clustered_partition, ordered by first member
+  unique_ptr<clustered_partition> make_partition( const CNVTYPE & type,
+						  const string & chrom1,
+						  const string & chrom2,
+						  vector<lvector> && clusters )
+  {
+    sort(clusters.begin(),clusters.end(),[](const lvector & lhs, const lvector & rhs) {
+	return member_less(lhs.front(),rhs.front());
+      });
+    unique_ptr<clustered_partition> p(new clustered_partition);
+    p->type = type;
+    p->chrom1 = chrom1;
+    p->chrom2 = chrom2;
+    size_t n = 0;
+    for( const auto & c : clusters ) n += c.size();
+    p->raw.reserve(n);
+    for( auto & c : clusters )
+      {
+	move(c.begin(),c.end(),back_inserter(p->raw));
+      }
+    auto itr = p->raw.cbegin();
+    for( const auto & c : clusters )
+      {
+	p->clusters.push_back( vector<lvector::const_iterator>() );
+	for( size_t i = 0 ; i < c.size() ; ++i ) p->clusters.back().push_back(itr++);
+      }
+    return p;
+  }
+
+  /*
+    Adds read pairs to a partition of the index.  Only the clusters that
+    one of the new pairs could link to are re-clustered, along with the
+    new pairs.  All other clusters are unchanged.
+  */
+  unique_ptr<clustered_partition> merge_partition( cnvindex_partition && old,
+						   lvector && added,
+						   const unsigned & mdist,
+						   unsigned * touched )
+  {
+    stable_sort(added.begin(),added.end(),member_less);
+    unsigned span = 0;
+    for( const auto & d : added )
+      {
+	span = max(span,max(d.a,d.aS)-min(d.a,d.aS));
+	span = max(span,max(d.b,d.bS)-min(d.b,d.bS));
+      }
+    const uint64_t window = uint64_t(span) + mdist;
+    //Pairs with swapped strands can link a cluster's a to their b
+    vector<lvector::const_iterator> byb;
+    for( auto i = added.cbegin() ; i != added.cend() ; ++i )
+      {
+	if( i->strand1 != i->strand2 ) byb.push_back(i);
+      }
+    sort(byb.begin(),byb.end(),[](const lvector::const_iterator & lhs, const lvector::const_iterator & rhs) {
+	return lhs->b < rhs->b;
+      });
+
+    vector<lvector> kept;
+    lvector combined;
+    for( auto & c : old.clusters )
+      {
+	const uint64_t lo = (c.amin > window) ? c.amin - window : 0,
+	  hi = uint64_t(c.amax) + mdist;
+	bool hit = false;
+	for( auto i = lower_bound(added.cbegin(),added.cend(),lo,[](const linkeddata & d, const uint64_t & v) {
+	      return d.a < v; }) ; !hit && i != added.cend() && i->a <= hi ; ++i )
+	  {
+	    hit = c.near(*i,mdist);
+	  }
+	for( auto i = lower_bound(byb.cbegin(),byb.cend(),lo,[](const lvector::const_iterator & d, const uint64_t & v) {
+	      return d->b < v; }) ; !hit && i != byb.cend() && (*i)->b <= hi ; ++i )
+	  {
+	    hit = c.near(**i,mdist);
+	  }
+	if( hit )
+	  {
+	    ++*touched;
+	    move(c.members.begin(),c.members.end(),back_inserter(combined));
+	  }
+	else
+	  {
+	    kept.emplace_back(std::move(c.members));
+	  }
+      }
+    move(added.begin(),added.end(),back_inserter(combined));
+    lvector().swap(added);
+
+    const cluster_container clusters = cluster_partition(combined,mdist);
+    for( const auto & c : clusters )
+      {
+	kept.push_back( lvector() );
+	for( auto i : c ) kept.back().push_back(*i);
+      }
+    return make_partition(CNVTYPE(old.type),old.chrom1,old.chrom2,std::move(kept));
+  }
+
+  /*
+    The new index while it is written, removed by remove_pending_index() if
+    the program exits on an error before it replaces the old index.
+  */
+  string pending_index;
+
+  void remove_pending_index()
+  {
+    if( !pending_index.empty() ) remove(pending_index.c_str());
+    pending_index.clear();
+  }
+
+  //true if in is at a clean end of file, i.e. no byte of another partition follows
+  bool at_end( gzFile in )
+  {
+    const int c = gzgetc(in);
+    if( c != -1 )
+      {
+	gzungetc(c,in);
+	return false;
+      }
+    int err;
+    gzerror(in,&err);
+    return err == Z_OK && gzeof(in);
+  }
+}
+
+cnvindex_header::cnvindex_header( const cluster_cnv_params & pars ) : sampleID(pars.sampleID),
+								      mdist(pars.mdist),
+								      samples(pars.samples),
+								      ok(true)
+{
+  //An index always labels its samples
+  if( samples.empty() ) samples.push_back(pars.sampleID);
+}
+
+cnvindex_header::cnvindex_header( gzFile in ) : sampleID(),mdist(0),samples(),ok(false)
+{
+  auto m = gzreadCstr(in);
+  if( m.second <= 0 || m.first != magic ) return;
+  uint32_t v,n;
+  if( !read_field(in,v) || v != version ) return;
+  auto name = gzreadCstr(in);
+  if( name.second <= 0 ) return;
+  sampleID = std::move(name.first);
+  if( !read_field(in,mdist) ) return;
+  if( !read_field(in,n) ) return;
+  for( uint32_t i = 0 ; i < n ; ++i )
+    {
+      auto label = gzreadCstr(in);
+      if( label.second <= 0 ) return;
+      samples.emplace_back(std::move(label.first));
+    }
+  ok = true;
+}
+
+int cnvindex_header::write( gzFile out ) const
+{
+  const uint32_t n = uint32_t(samples.size());
+  if( gzwriteCstr(out,magic) <= 0 ) return -1;
+  if( gzwrite(out,&version,sizeof(uint32_t)) <= 0 ) return -1;
+  if( gzwriteCstr(out,sampleID) <= 0 ) return -1;
+  if( gzwrite(out,&mdist,sizeof(unsigned)) <= 0 ) return -1;
+  if( gzwrite(out,&n,sizeof(uint32_t)) <= 0 ) return -1;
+  int rv = 1;
+  for( const auto & s : samples )
+    {
+      if( (rv = gzwriteCstr(out,s)) <= 0 ) return -1;
+    }
+  return rv;
+}
+
+cnvindex_cluster::cnvindex_cluster( lvector && __members ) : amin(numeric_limits<unsigned>::max()),amax(0),
+							     bmin(numeric_limits<unsigned>::max()),bmax(0),
+							     members(std::move(__members))
+{
+  for( const auto & d : members )
+    {
+      amin = min(amin,min(d.a,d.aS));
+      amax = max(amax,max(d.a,d.aS));
+      bmin = min(bmin,min(d.b,d.bS));
+      bmax = max(bmax,max(d.b,d.bS));
+    }
+}
+
+cnvindex_cluster::cnvindex_cluster( gzFile in ) : amin(0),amax(0),bmin(0),bmax(0),members()
+{
+  uint32_t n;
+  if( !read_field(in,amin) ) return;
+  if( !read_field(in,amax) ) return;
+  if( !read_field(in,bmin) ) return;
+  if( !read_field(in,bmax) ) return;
+  if( !read_field(in,n) ) return;
+  lvector temp;
+  temp.reserve(n);
+  for( uint32_t i = 0 ; i < n ; ++i )
+    {
+      temp.emplace_back(0,0,0,0,string(),0,0);
+      if( !read_member(in,temp.back()) ) return;
+    }
+  members.swap(temp);
+}
+
+int cnvindex_cluster::write( gzFile out ) const
+{
+  const uint32_t n = uint32_t(members.size());
+  if( gzwrite(out,&amin,sizeof(unsigned)) <= 0 ) return -1;
+  if( gzwrite(out,&amax,sizeof(unsigned)) <= 0 ) return -1;
+  if( gzwrite(out,&bmin,sizeof(unsigned)) <= 0 ) return -1;
+  if( gzwrite(out,&bmax,sizeof(unsigned)) <= 0 ) return -1;
+  int rv = gzwrite(out,&n,sizeof(uint32_t));
+  for( const auto & d : members )
+    {
+      if( (rv = write_member(out,d)) <= 0 ) return -1;
+    }
+  return rv;
+}
+
+bool cnvindex_cluster::near( const linkeddata & d, const unsigned & mdist ) const
+{
+  //Two ranges are near if they are within mdist of one another
+  auto close = [&mdist](const unsigned & lo1, const unsigned & hi1,
+			const unsigned & lo2, const unsigned & hi2) {
+    return uint64_t(lo1) <= uint64_t(hi2) + mdist && uint64_t(lo2) <= uint64_t(hi1) + mdist;
+  };
+  const unsigned alo = min(d.a,d.aS), ahi = max(d.a,d.aS),
+    blo = min(d.b,d.bS), bhi = max(d.b,d.bS);
+  return ( close(alo,ahi,amin,amax) && close(blo,bhi,bmin,bmax) ) ||
+    ( close(alo,ahi,bmin,bmax) && close(blo,bhi,amin,amax) );
+}
+
+cnvindex_partition::cnvindex_partition( const clustered_partition & p ) : type(int8_t(p.type)),
+									  chrom1(p.chrom1),
+									  chrom2(p.chrom2),
+									  clusters()
+{
+  clusters.reserve(p.clusters.size());
+  for( const auto & c : p.clusters )
+    {
+      lvector members;
+      members.reserve(c.size());
+      for( auto i : c ) members.push_back(*i);
+      clusters.emplace_back(std::move(members));
+    }
+}
+
+cnvindex_partition::cnvindex_partition( gzFile in ) : type(-1),chrom1(),chrom2(),clusters()
+{
+  int8_t t;
+  uint32_t n;
+  if( !read_field(in,t) ) return;
+  auto c1 = gzreadCstr(in);
+  if( c1.second <= 0 ) return;
+  auto c2 = gzreadCstr(in);
+  if( c2.second <= 0 ) return;
+  if( !read_field(in,n) ) return;
+  clusters.reserve(n);
+  for( uint32_t i = 0 ; i < n ; ++i )
+    {
+      clusters.emplace_back(in);
+      if( clusters.back().members.empty() ) return;
+    }
+  chrom1 = std::move(c1.first);
+  chrom2 = std::move(c2.first);
+  type = t;
+}
+
+int cnvindex_partition::write( gzFile out ) const
+{
+  const uint32_t n = uint32_t(clusters.size());
+  if( gzwrite(out,&type,sizeof(int8_t)) <= 0 ) return -1;
+  if( gzwriteCstr(out,chrom1) <= 0 ) return -1;
+  if( gzwriteCstr(out,chrom2) <= 0 ) return -1;
+  int rv = gzwrite(out,&n,sizeof(uint32_t));
+  for( const auto & c : clusters )
+    {
+      if( (rv = c.write(out)) <= 0 ) return -1;
+    }
+  return rv;
+}
+
+void cluster_cnv_update( const cluster_cnv_params & pars,
+			 gzFile divstream,
+			 gzFile parstream,
+			 gzFile ulstream )
+{
+  gzFile in = gzopen(pars.indexfile.c_str(),"rb");
+  if( in == NULL )
+    {
+      cerr << "Error: could not open "
+	   << pars.indexfile
+	   << " for reading\n";
+      exit(1);
+    }
+  const cnvindex_header h(in);
+  if( !h.ok )
+    {
+      cerr << "Error: " << pars.indexfile
+	   << " is not a cnvclust index\n";
+      exit(1);
+    }
+  if( h.mdist != pars.mdist )
+    {
+      cerr << "Error: the index was made with --maxdist "
+	   << h.mdist << ", not " << pars.mdist << '\n';
+      exit(1);
+    }
+
+  //The new samples are numbered after those in the index
+  const vector<string> added = pars.samples.empty() ? vector<string>(1,pars.sampleID) : pars.samples;
+  cluster_cnv_params upars(pars);
+  upars.sampleID = h.sampleID;
+  upars.samples = h.samples;
+  for( const auto & s : added )
+    {
+      if( find(upars.samples.begin(),upars.samples.end(),s) != upars.samples.end() )
+	{
+	  cerr << "Error: sample " << s
+	       << " is already in " << pars.indexfile << '\n';
+	  exit(1);
+	}
+      upars.samples.push_back(s);
+    }
+  //Write the new index next to the old one, and replace it when done
+  upars.indexfile = pars.indexfile + ".tmp";
+  static bool registered = false;
+  if( !registered ) registered = (atexit(remove_pending_index) == 0);
+
+  const unsigned offset = unsigned(h.samples.size());
+  chromdict chroms;
+  unordered_map<uint64_t,lvector> raw[3];
+  read_all(pars,chroms,[&](const CNVTYPE & type, const uint64_t & key, linkeddata && d) {
+      d.sample += offset;
+      raw[type][key].emplace_back(std::move(d));
+    });
+
+  //Partitions are in the same order as in the index
+  using pkey = tuple<int8_t,string,string>;
+  map<pkey,lvector> data;
+  for( int8_t type = 0 ; type < 3 ; ++type )
+    {
+      for( auto & r : raw[type] )
+	{
+	  data[make_tuple(type,chroms.name(packed_first(r.first)),chroms.name(packed_second(r.first)))] = std::move(r.second);
+	}
+      raw[type].clear();
+    }
+
+  pending_index = upars.indexfile;
+  partition_writer writer(upars,divstream,parstream,ulstream);
+  auto fresh = [&writer](map<pkey,lvector>::iterator & i) {
+    writer.submit( CNVTYPE(get<0>(i->first)), get<1>(i->first), get<2>(i->first), std::move(i->second) );
+  };
+  unsigned touched = 0, total = 0;
+  auto next = data.begin();
+  //The index may only end between partitions.  Anything else is a truncated or corrupt file.
+  while( !at_end(in) )
+    {
+      cnvindex_partition old(in);
+      if( old.type == -1 )
+	{
+	  cerr << "Error: could not read "
+	       << pars.indexfile << ", which may be truncated.  It has not been changed.\n";
+	  exit(1);
+	}
+      total += unsigned(old.clusters.size());
+      const pkey k(old.type,old.chrom1,old.chrom2);
+      for( ; next != data.end() && next->first < k ; ++next ) fresh(next);
+      if( next != data.end() && next->first == k )
+	{
+	  writer.submit( merge_partition(std::move(old),std::move(next->second),pars.mdist,&touched) );
+	  ++next;
+	}
+      else
+	{
+	  vector<lvector> clusters;
+	  for( auto & c : old.clusters ) clusters.emplace_back(std::move(c.members));
+	  writer.submit( make_partition(CNVTYPE(old.type),old.chrom1,old.chrom2,std::move(clusters)) );
+	}
+    }
+  for( ; next != data.end() ; ++next ) fresh(next);
+  writer.finish();
+  gzclose(in);
+
+  if( rename(upars.indexfile.c_str(),pars.indexfile.c_str()) != 0 )
+    {
+      cerr << "Error: could not rename "
+	   << upars.indexfile << " to "
+	   << pars.indexfile << '\n';
+      exit(1);
+    }
+  pending_index.clear();
+  cerr << "re-clustered " << touched << " of " << total << " existing clusters\n";
+}
@@ -0,0 +1,59 @@
+#ifndef __PECNV_CLUSTER_CNV_INDEX_HPP__
+#define __PECNV_CLUSTER_CNV_INDEX_HPP__
+
+#include <cluster_cnv_objects.hpp>
+
+/*
+  Persistent cluster index, written by cnvclust --index and updated by
+  cnvclust --update.
+
+  The file is gzipped binary.  It starts with a cnvindex_header, followed by one
+  cnvindex_partition per (type, chromosome[-pair]), in output order.  Each cluster
+  stores its bounding box and its members, so that adding a sample only requires
+  re-clustering the clusters that the new read pairs can link to.
+*/
+
+struct cnvindex_header
+{
+  std::string sampleID;             //--sample/-s of the run that made the index
+  unsigned mdist;                   //--maxdist/-d of the run that made the index
+  std::vector<std::string> samples; //sample labels, in order of linkeddata::sample
+  bool ok;                          //false if reading failed
+  cnvindex_header( const cluster_cnv_params & pars );
+  cnvindex_header( gzFile in ); //construct via input from a gzFile
+  int write( gzFile out ) const;
+};
+
+struct cnvindex_cluster
+{
+  unsigned amin,amax,bmin,bmax; //bounding box of the members
+  lvector members;              //sorted by (a,b,sample)
+  cnvindex_cluster( lvector && __members );
+  cnvindex_cluster( gzFile in ); //construct via input from a gzFile.  members is empty on failure
+  int write( gzFile out ) const;
+  //true if d could link to a member of this cluster
+  bool near( const linkeddata & d, const unsigned & mdist ) const;
+};
+
+struct cnvindex_partition
+{
+  std::int8_t type; //a CNVTYPE, or -1 if reading failed
+  std::string chrom1,chrom2;
+  std::vector<cnvindex_cluster> clusters;
+  cnvindex_partition( const clustered_partition & p );
+  cnvindex_partition( gzFile in ); //construct via input from a gzFile
+  int write( gzFile out ) const;
+};
+
+/*
+  cnvclust --update.  Reads the samples in pars, and merges them into
+  the clusters in pars.indexfile.  The index is rewritten, and all clusters
+  are written to the output streams, as if all samples had been clustered
+  jointly.
+*/
+void cluster_cnv_update( const cluster_cnv_params & pars,
+			 gzFile divstream,
+			 gzFile parstream,
+			 gzFile ulstream );
+
+#endif
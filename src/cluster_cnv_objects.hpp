@@ -0,0 +1,167 @@
+#ifndef __PECNV_CLUSTER_CNV_OBJECTS_HPP__
+#define __PECNV_CLUSTER_CNV_OBJECTS_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <functional>
+#include <deque>
+#include <future>
+#include <memory>
+#include <zlib.h>
+#include <chromdict.hpp>
+
+struct linkeddata
+{
+  mutable unsigned a,aS,b,bS; //positions on strands -- start1,stop1,start2,stop2
+  mutable std::string readname;
+  short strand1,strand2;
+  unsigned sample; //index into cluster_cnv_params::samples in joint mode, else 0
+  linkeddata(const unsigned & __a,
+	     const unsigned & __aS,
+	     const unsigned & __b,
+	     const unsigned & __bS,
+	     const std::string & __readname,
+	     const short & _strand1,
+	     const short & _strand2,
+	     const unsigned & _sample = 0) : a(__a),
+					     aS(__aS),
+					     b(__b),
+					     bS(__bS),
+					     readname( __readname ),
+					     strand1(_strand1),strand2(_strand2),
+					     sample(_sample)
+  {
+  }
+};
+
+using lvector = std::vector<linkeddata>;
+using cluster_container = std::vector< std::vector<lvector::const_iterator> >;
+
+//The three types of read pair that are clustered.  The values index the output streams.
+enum CNVTYPE { CNV_DIV = 0, CNV_PAR = 1, CNV_UNL = 2 };
+
+struct cluster_cnv_params
+{
+  std::string sampleID;
+  std::int8_t min_mqual;
+  std::int16_t max_mm,max_gap;
+  unsigned mdist;
+  std::string divfile,parfile,ulfile;
+  std::vector<std::string> infiles;
+  /*
+    Joint mode: a label for each sample, and that sample's input files.
+    Read from the manifest passed to --joint/-j.
+  */
+  std::vector<std::string> samples;
+  std::vector<std::vector<std::string> > samplefiles;
+  /*
+    For external-memory mode: max. number of read pairs per temporary run
+    (0 = hold everything in memory), and where to put the runs
+  */
+  unsigned runsize;
+  std::string tmpdir;
+  //Max. number of partitions clustered concurrently
+  unsigned nthreads;
+  /*
+    Cluster index file (see cluster_cnv_index.hpp).  It is written if
+    non-empty, and if update is true it is first read, and the input
+    samples are added to it.
+  */
+  std::string indexfile;
+  bool update;
+  /*
+    Parameter sweep: all values given to --mqual/-m, --maxmm/-M, --maxgap/-g
+    and --maxdist/-d.  The single values above are the first of each.
+  */
+  std::vector<std::int8_t> mquals;
+  std::vector<std::int16_t> maxmms,maxgaps;
+  std::vector<unsigned> mdists;
+};
+
+/*
+  Called once per read pair passing the filters.  key = pack_refids(id1,id2),
+  where id2 == id1 for DIV and PAR.
+*/
+using linkeddata_callback = std::function<void(const CNVTYPE & type,
+					       const std::uint64_t & key,
+					       linkeddata && d)>;
+
+//The lowest mapping quality, and the most mismatches and gaps, of the two reads in a pair
+struct pairquality
+{
+  std::int8_t mapq;
+  std::int16_t mm,ngap;
+  bool passes( const std::int8_t & min_mqual,
+	       const std::int16_t & max_mm,
+	       const std::int16_t & max_gap ) const;
+};
+
+using pairdata_callback = std::function<void(const CNVTYPE & type,
+					     const std::uint64_t & key,
+					     linkeddata && d,
+					     const pairquality & q)>;
+
+//Calls f for every read pair in the file
+void read_data(const char * filename,
+	       chromdict & chroms,
+	       const pairdata_callback & f);
+
+//Calls read_data on every input file, setting linkeddata::sample in joint mode
+void read_all_unfiltered(const cluster_cnv_params & pars,
+			 chromdict & chroms,
+			 const pairdata_callback & f);
+
+//As read_all_unfiltered, but only for the pairs passing the filters in pars
+void read_all(const cluster_cnv_params & pars,
+	      chromdict & chroms,
+	      const linkeddata_callback & f);
+
+/*
+  Clusters the read pairs from one chromosome (or pair of chromosomes, for UNL).
+  raw is sorted, and duplicate positions within a sample are removed
+  (keeping the first occurrence in input order).
+*/
+cluster_container cluster_partition( lvector & raw,
+				     const unsigned & mdist );
+
+struct clustered_partition
+{
+  CNVTYPE type;
+  std::string chrom1,chrom2;
+  lvector raw;
+  cluster_container clusters; //iterators into raw
+};
+
+/*
+  Clusters partitions and writes them to the output stream for their type,
+  in the order in which they were submitted.  Event ids are numbered
+  consecutively within each type.  With pars.nthreads > 1, up to nthreads
+  partitions are clustered concurrently while the caller prepares the next one.
+  If pars.indexfile is not empty, the clusters are also written to that index.
+*/
+struct partition_writer
+{
+  const cluster_cnv_params & pars;
+  gzFile streams[3];
+  gzFile index;
+  unsigned eventids[3];
+  std::deque< std::future< std::unique_ptr<clustered_partition> > > pending;
+
+  partition_writer( const cluster_cnv_params & __pars,
+		    gzFile divstream,
+		    gzFile parstream,
+		    gzFile ulstream );
+  ~partition_writer();
+  void submit( const CNVTYPE & type,
+	       const std::string & chrom1,
+	       const std::string & chrom2,
+	       lvector && raw );
+  //Submit a partition that is already clustered
+  void submit( std::unique_ptr<clustered_partition> && p );
+  //Wait for, and write, all pending partitions
+  void finish();
+  void write( const clustered_partition & p );
+};
+
+#endif
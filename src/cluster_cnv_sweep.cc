@@ -0,0 +1,139 @@
+#include <cluster_cnv_sweep.hpp>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <iostream>
+#include <cstdlib>
+
+using namespace std;
+
+namespace
+{
+  struct pairdata
+  {
+    linkeddata d;
+    pairquality q;
+    pairdata( linkeddata && __d, const pairquality & __q ) : d(std::move(__d)),q(__q)
+    {
+    }
+  };
+
+  //All read pairs, by partition, in output order
+  using pkey = tuple<int8_t,string,string>;
+  using sweepdata = map<pkey,vector<pairdata> >;
+
+  //Insert the parameter values before the .gz extension of an output file name
+  string sweep_filename( const string & name, const string & suffix )
+  {
+    const string ext = ".gz";
+    if( name.size() > ext.size() && name.compare(name.size()-ext.size(),ext.size(),ext) == 0 )
+      {
+	return name.substr(0,name.size()-ext.size()) + suffix + ext;
+      }
+    return name + suffix;
+  }
+
+  gzFile open_output( const string & name )
+  {
+    gzFile f = gzopen(name.c_str(),"wb");
+    if( f == NULL )
+      {
+	cerr << "Error: could not open "
+	     << name
+	     << " for writing\n";
+	exit(1);
+      }
+    return f;
+  }
+
+  //Filter, cluster, and write one combination of parameters
+  void run_combination( const cluster_cnv_params & cp,
+			const sweepdata & data )
+  {
+    gzFile divstream = open_output(cp.divfile),
+      parstream = open_output(cp.parfile),
+      ulstream = open_output(cp.ulfile);
+    partition_writer writer(cp,divstream,parstream,ulstream);
+    for( const auto & p : data )
+      {
+	lvector raw;
+	for( const auto & pd : p.second )
+	  {
+	    if( pd.q.passes(cp.min_mqual,cp.max_mm,cp.max_gap) ) raw.push_back(pd.d);
+	  }
+	if( raw.empty() ) continue;
+	writer.submit( CNVTYPE(get<0>(p.first)), get<1>(p.first), get<2>(p.first), std::move(raw) );
+      }
+    writer.finish();
+    gzclose(parstream);
+    gzclose(ulstream);
+    gzclose(divstream);
+  }
+}
+
+void cluster_cnv_sweep( const cluster_cnv_params & pars )
+{
+  chromdict chroms;
+  unordered_map<uint64_t,vector<pairdata> > raw[3];
+  read_all_unfiltered(pars,chroms,
+		      [&raw](const CNVTYPE & type, const uint64_t & key, linkeddata && d, const pairquality & q) {
+			raw[type][key].emplace_back(std::move(d),q);
+		      });
+  sweepdata data;
+  for( int8_t type = 0 ; type < 3 ; ++type )
+    {
+      for( auto & r : raw[type] )
+	{
+	  data[make_tuple(type,chroms.name(packed_first(r.first)),chroms.name(packed_second(r.first)))] = std::move(r.second);
+	}
+      raw[type].clear();
+    }
+
+  vector<cluster_cnv_params> combinations;
+  for( auto m : pars.mquals )
+    for( auto mm : pars.maxmms )
+      for( auto g : pars.maxgaps )
+	for( auto d : pars.mdists )
+	  {
+	    cluster_cnv_params cp(pars);
+	    cp.min_mqual = m;
+	    cp.max_mm = mm;
+	    cp.max_gap = g;
+	    cp.mdist = d;
+	    ostringstream suffix;
+	    suffix << ".m" << int(m) << ".M" << mm << ".g" << g << ".d" << d;
+	    cp.divfile = sweep_filename(pars.divfile,suffix.str());
+	    cp.parfile = sweep_filename(pars.parfile,suffix.str());
+	    cp.ulfile = sweep_filename(pars.ulfile,suffix.str());
+	    if( !pars.indexfile.empty() ) cp.indexfile = sweep_filename(pars.indexfile,suffix.str());
+	    combinations.push_back(cp);
+	  }
+
+  //Threads go to combinations first, and any left over to partitions within each
+  const unsigned nworkers = unsigned(min(size_t(pars.nthreads),combinations.size()));
+  for( auto & cp : combinations ) cp.nthreads = max(1u,pars.nthreads/nworkers);
+
+  atomic<size_t> next(0);
+  mutex logmutex;
+  auto worker = [&]() {
+    for( size_t i = next++ ; i < combinations.size() ; i = next++ )
+      {
+	{
+	  lock_guard<mutex> lock(logmutex);
+	  cerr << "clustering " << combinations[i].divfile << ", "
+	       << combinations[i].parfile << ", "
+	       << combinations[i].ulfile << '\n';
+	}
+	run_combination(combinations[i],data);
+      }
+  };
+  vector<thread> threads;
+  for( unsigned i = 1 ; i < nworkers ; ++i ) threads.emplace_back(worker);
+  worker();
+  for( auto & t : threads ) t.join();
+}
@@ -0,0 +1,17 @@
+#ifndef __PECNV_CLUSTER_CNV_SWEEP_HPP__
+#define __PECNV_CLUSTER_CNV_SWEEP_HPP__
+
+#include <cluster_cnv_objects.hpp>
+
+/*
+  Parameter sweep for cnvclust.  The input files are read once, without
+  filtering.  Then, for every combination of pars.mquals, pars.maxmms,
+  pars.maxgaps and pars.mdists, the read pairs passing the filters are
+  clustered and written to their own set of output files.  The combination
+  is added to the output file names, e.g. div_clusters.gz becomes
+  div_clusters.m30.M3.g0.d600.gz.  Up to pars.nthreads combinations
+  run concurrently.
+*/
+void cluster_cnv_sweep( const cluster_cnv_params & pars );
+
+#endif
@@ -0,0 +1,62 @@
+/*
+  Quantiles of an insert size distribution, from the output of pecnv mdist
+*/
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <file_common.hpp>
+#include <isize_histogram.hpp>
+#include <zlib.h>
+
+using namespace std;
+using namespace boost::program_options;
+
+int insert_qtile_main( int argc, char ** argv )
+{
+  string infile,qs;
+  options_description desc("pecnv qtile: print quantiles of the insert size distribution estimated by pecnv mdist, one per line.\nUsage: pecnv qtile mdistfile 0.99[,0.999,...]");
+  desc.add_options()
+    ("help,h", "Produce help message")
+    ("infile,i",value<string>(&infile),"Input file (the output of pecnv mdist)")
+    ("quantiles,q",value<string>(&qs),"Comma-separated list of quantiles, each >= 0 and <= 1")
+    ;
+  positional_options_description pos;
+  pos.add("infile",1).add("quantiles",1);
+
+  variables_map vm;
+  store(command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+  notify(vm);
+
+  if( argc == 1 ||
+      vm.count("help") ||
+      !vm.count("infile") ||
+      !vm.count("quantiles") )
+    {
+      cerr << desc << '\n';
+      exit(0);
+    }
+  if (!file_exists(infile.c_str()))
+    {
+      cerr << "Error: input file "
+	   << infile
+	   << " does not exist\n";
+      exit(1);
+    }
+  const vector<double> q = parse_quantiles(qs);
+
+  gzFile in = gzopen(infile.c_str(),"r");
+  if( in == NULL )
+    {
+      cerr << "Error: could not open "
+	   << infile
+	   << " for reading\n";
+      exit(1);
+    }
+  isize_histogram mdist(in);
+  gzclose(in);
+
+  for( auto d : mdist.quantiles(q) ) cout << d << '\n';
+  return 0;
+}
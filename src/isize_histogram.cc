@@ -0,0 +1,143 @@
+#include <isize_histogram.hpp>
+#include <algorithm>
+#include <numeric>
+#include <sstream>
+#include <iostream>
+#include <cstdlib>
+
+using namespace std;
+
+isize_histogram::isize_histogram( const unsigned & ndense ) : dense(ndense,0),overflow(),total(0)
+{
+}
+
+isize_histogram::isize_histogram( gzFile in ) : dense(65536,0),overflow(),total(0)
+{
+  char buffer[256];
+  if( gzgets(in,buffer,256) == NULL ) return; //empty file
+  if( string(buffer) != "distance\tnumber\tcprob\n" )
+    {
+      cerr << "Error: unexpected header in insert size distribution file: " << buffer << '\n';
+      exit(1);
+    }
+  while( gzgets(in,buffer,256) != NULL )
+    {
+      istringstream line(buffer);
+      unsigned distance;
+      uint64_t n;
+      if( !(line >> distance >> n) )
+	{
+	  cerr << "Error: could not parse line of insert size distribution file: " << buffer << '\n';
+	  exit(1);
+	}
+      add(distance,n);
+    }
+}
+
+void isize_histogram::merge( const isize_histogram & rhs )
+{
+  if( rhs.dense.size() > dense.size() )
+    {
+      dense.resize(rhs.dense.size(),0);
+      //Move what now fits into the dense array
+      auto end = overflow.lower_bound(unsigned(dense.size()));
+      for( auto i = overflow.begin() ; i != end ; ++i ) dense[i->first] += i->second;
+      overflow.erase(overflow.begin(),end);
+    }
+  for( size_t i = 0 ; i < rhs.dense.size() ; ++i ) dense[i] += rhs.dense[i];
+  for( const auto & o : rhs.overflow )
+    {
+      if( o.first < dense.size() ) dense[o.first] += o.second;
+      else overflow[o.first] += o.second;
+    }
+  total += rhs.total;
+}
+
+void isize_histogram::visit( const function<void(const unsigned &, const uint64_t &)> & f ) const
+{
+  for( unsigned i = 0 ; i < dense.size() ; ++i )
+    {
+      if( dense[i] ) f(i,dense[i]);
+    }
+  for( const auto & o : overflow ) f(o.first,o.second);
+}
+
+int isize_histogram::write( gzFile out ) const
+{
+  const char * header = "distance\tnumber\tcprob\n";
+  if( gzputs(out,header) <= 0 ) return -1;
+  uint64_t cum = 0;
+  int rv = 1;
+  visit([&](const unsigned & distance, const uint64_t & count) {
+      if( rv <= 0 ) return;
+      cum += count;
+      rv = gzprintf(out,"%u\t%llu\t%e\n",distance,
+		    (unsigned long long)count,double(cum)/double(total));
+    });
+  return rv;
+}
+
+vector<unsigned> isize_histogram::quantiles( const vector<double> & qs ) const
+{
+  vector<unsigned> rv(qs.size(),0);
+  if( !total ) return rv;
+  //Visit the quantiles in increasing order during a single pass over the histogram
+  vector<size_t> order(qs.size());
+  iota(order.begin(),order.end(),0);
+  sort(order.begin(),order.end(),[&qs](const size_t & lhs, const size_t & rhs) { return qs[lhs] < qs[rhs]; });
+  auto next = order.cbegin();
+  uint64_t cum = 0;
+  visit([&](const unsigned & distance, const uint64_t & count) {
+      cum += count;
+      const double cprob = double(cum)/double(total);
+      for( ; next != order.cend() && cprob >= qs[*next] ; ++next ) rv[*next] = distance;
+    });
+  return rv;
+}
+
+quantile_convergence::quantile_convergence( const vector<double> & __qs,
+					    const unsigned & __tolerance,
+					    const unsigned & __nstable,
+					    const uint64_t & __batchsize ) : qs(__qs),
+									     tolerance(__tolerance),
+									     nstable(__nstable),
+									     batchsize(__batchsize),
+									     last(),
+									     stable(0),
+									     next(__batchsize)
+{
+}
+
+bool quantile_convergence::update( const isize_histogram & h )
+{
+  next = h.total + batchsize;
+  vector<unsigned> current = h.quantiles(qs);
+  bool same = !last.empty();
+  for( size_t i = 0 ; same && i < current.size() ; ++i )
+    {
+      same = max(current[i],last[i]) - min(current[i],last[i]) <= tolerance;
+    }
+  stable = same ? stable + 1 : 0;
+  last.swap(current);
+  return stable >= nstable;
+}
+
+vector<double> parse_quantiles( const string & qs )
+{
+  vector<double> rv;
+  istringstream in(qs);
+  string field;
+  while( getline(in,field,',') )
+    {
+      istringstream f(field);
+      double q;
+      if( !(f >> q) || q < 0. || q > 1. )
+	{
+	  cerr << "Error: quantile " << field
+	       << " is not a number 0 <= x <= 1\n";
+	  exit(1);
+	}
+      rv.push_back(q);
+    }
+  return rv;
+}
@@ -0,0 +1,72 @@
+#ifndef __PECNV_ISIZE_HISTOGRAM_HPP__
+#define __PECNV_ISIZE_HISTOGRAM_HPP__
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <string>
+#include <functional>
+#include <zlib.h>
+
+/*
+  Histogram of insert sizes.  Distances below dense.size() are counted
+  in a flat array, and the (rare) larger ones in an overflow map.
+*/
+struct isize_histogram
+{
+  std::vector<std::uint64_t> dense;
+  std::map<unsigned,std::uint64_t> overflow;
+  std::uint64_t total;
+
+  explicit isize_histogram( const unsigned & ndense = 65536 );
+  //Read the table written by write().  Exits with an error message on failure.
+  isize_histogram( gzFile in );
+  inline void add( const unsigned & distance, const std::uint64_t & n = 1 )
+  {
+    if( distance < dense.size() ) dense[distance] += n;
+    else overflow[distance] += n;
+    total += n;
+  }
+  //Add the counts in rhs to this
+  void merge( const isize_histogram & rhs );
+  //Calls f(distance,count) for each observed distance, in increasing order
+  void visit( const std::function<void(const unsigned &, const std::uint64_t &)> & f ) const;
+  //Write the distance, number, cprob table that is the output of pecnv mdist
+  int write( gzFile out ) const;
+  /*
+    For each q in qs, the smallest distance whose cumulative probability is >= q.
+    qs need not be sorted.  Returns 0 for each q if the histogram is empty.
+  */
+  std::vector<unsigned> quantiles( const std::vector<double> & qs ) const;
+};
+
+/*
+  Adaptive sampling: every batchsize pairs, the quantiles qs are recomputed.
+  Sampling has converged once none of them has moved by more than
+  tolerance (bp) for nstable consecutive batches.
+*/
+struct quantile_convergence
+{
+  std::vector<double> qs;
+  unsigned tolerance,nstable;
+  std::uint64_t batchsize;
+  std::vector<unsigned> last;
+  unsigned stable;
+  std::uint64_t next;
+  quantile_convergence( const std::vector<double> & __qs,
+			const unsigned & __tolerance,
+			const unsigned & __nstable,
+			const std::uint64_t & __batchsize );
+  //Call as pairs are added to h.  Returns true once sampling has converged.
+  inline bool done( const isize_histogram & h )
+  {
+    if( h.total < next ) return false;
+    return update(h);
+  }
+  bool update( const isize_histogram & h );
+};
+
+//Parse a comma-separated list of quantiles, e.g. "0.99,0.999".  Exits with an error message if any is not in [0,1].
+std::vector<double> parse_quantiles( const std::string & qs );
+
+#endif
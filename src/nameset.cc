@@ -0,0 +1,130 @@
+#include <nameset.hpp>
+#include <cstring>
+
+using namespace std;
+
+uint64_t name_fingerprint( const char * name, const size_t & len )
+{
+  //FNV-1a, followed by the finalizer of MurmurHash3 so that all bits are mixed
+  uint64_t h = 14695981039346656037ULL;
+  for( size_t i = 0 ; i < len ; ++i )
+    {
+      h ^= uint64_t((unsigned char)(name[i]));
+      h *= 1099511628211ULL;
+    }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (h == 0) ? 1 : h;
+}
+
+nameset::nameset( const bool & __keepnames ) : slots(16,0),
+					       offsets(__keepnames ? 16 : 0,0),
+					       names(),
+					       bloom(),
+					       n(0),
+					       keepnames(__keepnames)
+{
+}
+
+size_t nameset::find( const char * name, const size_t & len, const uint64_t & fp ) const
+{
+  const size_t mask = slots.size() - 1;
+  for( size_t i = size_t(fp) & mask ; ; i = (i+1) & mask )
+    {
+      if( slots[i] == 0 ) return i;
+      if( slots[i] == fp )
+	{
+	  if( !keepnames ) return i;
+	  const char * stored = names.data() + offsets[i];
+	  if( strncmp(stored,name,len) == 0 && stored[len] == '\0' ) return i;
+	}
+    }
+}
+
+void nameset::grow()
+{
+  vector<uint64_t> oldslots,oldoffsets;
+  oldslots.swap(slots);
+  oldoffsets.swap(offsets);
+  slots.assign(oldslots.size()*2,0);
+  if( keepnames ) offsets.assign(oldslots.size()*2,0);
+  const size_t mask = slots.size() - 1;
+  for( size_t j = 0 ; j < oldslots.size() ; ++j )
+    {
+      if( oldslots[j] == 0 ) continue;
+      size_t i = size_t(oldslots[j]) & mask;
+      while( slots[i] != 0 ) i = (i+1) & mask;
+      slots[i] = oldslots[j];
+      if( keepnames ) offsets[i] = oldoffsets[j];
+    }
+}
+
+bool nameset::insert( const char * name, const size_t & len )
+{
+  const uint64_t fp = name_fingerprint(name,len);
+  size_t i = find(name,len,fp);
+  if( slots[i] != 0 ) return false;
+  if( 2*(n+1) > slots.size() )
+    {
+      grow();
+      i = find(name,len,fp);
+    }
+  slots[i] = fp;
+  if( keepnames )
+    {
+      offsets[i] = names.size();
+      names.append(name,len);
+      names.push_back('\0');
+    }
+  if( !bloom.empty() ) set_bloom(fp);
+  ++n;
+  return true;
+}
+
+bool nameset::contains( const char * name, const size_t & len ) const
+{
+  if( n == 0 ) return false;
+  const uint64_t fp = name_fingerprint(name,len);
+  if( !bloom.empty() && !test_bloom(fp) ) return false;
+  return slots[find(name,len,fp)] != 0;
+}
+
+/*
+  Four bits per name, all in one word of the filter.  The word is chosen by
+  the high half of the fingerprint, and the bits by four 6-bit fields of the
+  low half.
+  The filter has a power of 2 number of words.
+*/
+namespace
+{
+  inline uint64_t bloom_bits( const uint64_t & fp )
+  {
+    return (uint64_t(1) << ((fp >> 8) & 63)) | (uint64_t(1) << ((fp >> 14) & 63)) |
+      (uint64_t(1) << ((fp >> 20) & 63)) | (uint64_t(1) << ((fp >> 26) & 63));
+  }
+}
+
+void nameset::set_bloom( const uint64_t & fp )
+{
+  bloom[(fp >> 32) & (bloom.size()-1)] |= bloom_bits(fp);
+}
+
+bool nameset::test_bloom( const uint64_t & fp ) const
+{
+  const uint64_t bits = bloom_bits(fp);
+  return (bloom[(fp >> 32) & (bloom.size()-1)] & bits) == bits;
+}
+
+void nameset::build_filter()
+{
+  size_t nwords = 1;
+  while( nwords*64 < 16*n ) nwords *= 2;
+  bloom.assign(nwords,0);
+  for( const auto & fp : slots )
+    {
+      if( fp != 0 ) set_bloom(fp);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef __PECNV_NAMESET_HPP__
+#define __PECNV_NAMESET_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+//Length of the part of readname before any '#', i.e. of editRname(readname), without making a copy
+inline std::size_t rname_length( const std::string & readname )
+{
+  auto pound = readname.find('#');
+  return (pound == std::string::npos) ? readname.size() : pound;
+}
+
+//64-bit hash of a read name.  Never 0.
+std::uint64_t name_fingerprint( const char * name, const std::size_t & len );
+
+/*
+  A set of read names, stored as 64-bit fingerprints in an open-addressing
+  table (linear probing, at most half full).  If keepnames is true, the
+  names themselves are kept, one after another in a single string, and a
+  matching fingerprint is confirmed by comparing names.  Otherwise, two names
+  with the same fingerprint are taken to be the same.
+
+  build_filter() adds a blocked Bloom filter with ~16 bits per name, which
+  is checked before the table.  All the bits for a name are in one 64-bit
+  word, so most names that are not in the set are rejected with a single
+  memory access, to a filter one eighth the size of the table, instead of
+  a probe of the table.
+*/
+struct nameset
+{
+  std::vector<std::uint64_t> slots;   //fingerprints, 0 = empty
+  std::vector<std::uint64_t> offsets; //if keepnames, where each name starts in names
+  std::string names;                  //names, each followed by '\0'
+  std::vector<std::uint64_t> bloom;   //empty unless build_filter() is called
+  std::size_t n;
+  bool keepnames;
+
+  explicit nameset( const bool & __keepnames = true );
+  //Returns true if name was not already in the set
+  bool insert( const char * name, const std::size_t & len );
+  bool insert( const std::string & name ) { return insert(name.data(),name.size()); }
+  bool contains( const char * name, const std::size_t & len ) const;
+  bool contains( const std::string & name ) const { return contains(name.data(),name.size()); }
+  //Build the Bloom filter for the names now in the set.  Names inserted later are added to it.
+  void build_filter();
+  std::size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+private:
+  //The slot holding name, or the empty slot where it would go
+  std::size_t find( const char * name, const std::size_t & len, const std::uint64_t & fp ) const;
+  void grow();
+  void set_bloom( const std::uint64_t & fp );
+  bool test_bloom( const std::uint64_t & fp ) const;
+};
+
+#endif
@@ -3,7 +3,9 @@
 #include <process_readmappings.hpp>
 #include <cluster_cnv.hpp>
 #include <mdist.hpp>
+#include <qtile.hpp>
 #include <mkgenome.hpp>
+#include <teindex.hpp>
 #include <algorithm>
 #include <cstring>
 #include <iostream>
@@ -46,11 +48,21 @@ int main( int argc, char ** argv )
       auto x = strip_argv(argc,argv,argv[1]);
       bwa_mapdistance_main(x - argv, argv);
     }
+  else if( strcmp(argv[1],"qtile") == 0 )
+    {
+      auto x = strip_argv(argc,argv,argv[1]);
+      insert_qtile_main(x - argv, argv);
+    }
   else if( strcmp(argv[1],"teclust") == 0 )
     {
       auto x = strip_argv(argc,argv,argv[1]);
       teclust_main(x - argv, argv);
     }
+  else if( strcmp(argv[1],"teindex") == 0 )
+    {
+      auto x = strip_argv(argc,argv,argv[1]);
+      teindex_main(x - argv,argv);
+    }
   else if( strcmp(argv[1],"mkgenome") == 0 )
     {
       auto x = strip_argv(argc,argv,argv[1]);
@@ -79,7 +91,9 @@ void usage(int status)
        << "\t\tcnvclust - perform CNV clustering based on results from process step\n"
        << "\t\tteclust - perform TE clustering based on results from process step\n"
        << "\tManipulating data files\n"
+       << "\t\tqtile - print quantiles of the insert size distribution from the mdist step\n"
        << "\t\tmkgenome - makes a \"genome file\" for bedtools from a fasta input file\n"
+       << "\t\tteindex - makes an index of reference TE positions for teclust from a BED file\n"
        << "\tProviding info about this program:\n"
        << "\t\tversion - print version info to stdout\n"
        << "\t\tcitation - print citation info to stdout\n";
@@ -1,5 +1,5 @@
 /*
-  The program processes a BAM file and collects the following unusual read pairs:
+  The program processes one or more BAM files and collects the following unusual read pairs:
   1. Divergent orientation
   2. Parallel orientation
   3. Mapping to different chromosomes
@@ -22,6 +22,9 @@
 #include <algorithm>
 #include <cassert>
 #include <sstream>
+#include <atomic>
+#include <thread>
+#include <cstdio>
 #include <boost/program_options.hpp>
 #include <common.hpp>
 #include <intermediateIO.hpp>
@@ -45,18 +48,24 @@ struct output_files
   gzFile structural,um_u,um_m,
     structural_sam,um_sam;
 
-  output_files(const char * structural_base, const char * um_base) :
-    structural_fn(structural_base),
-    structural_sam_fn(structural_base),
-    um_u_fn(um_base),
-    um_m_fn(um_base),
-    um_sam_fn(um_base)
+  //The names of the output files, in the order declared above
+  static vector<string> filenames(const string & structural_base, const string & um_base)
   {
-    structural_fn += ".csv.gz";
-    structural_sam_fn += ".sam.gz";
-    um_u_fn += "_u.csv.gz";
-    um_m_fn += "_m.csv.gz";
-    um_sam_fn += ".sam.gz";
+    return { structural_base + ".csv.gz",
+	structural_base + ".sam.gz",
+	um_base + "_u.csv.gz",
+	um_base + "_m.csv.gz",
+	um_base + ".sam.gz" };
+  }
+
+  output_files(const char * structural_base, const char * um_base)
+  {
+    auto fns = filenames(structural_base,um_base);
+    structural_fn = fns[0];
+    structural_sam_fn = fns[1];
+    um_u_fn = fns[2];
+    um_m_fn = fns[3];
+    um_sam_fn = fns[4];
 
     structural = gzopen(structural_fn.c_str(),"w");
     if ( structural == NULL ) {
@@ -134,20 +143,112 @@ string toSAM(const bamrecord & b,
 
 struct process_mapping_params
 {
-  string bamfile,structural_base,um_base;
+  vector<string> bamfiles;
+  string structural_base,um_base;
+  unsigned nthreads;
 };
 
 process_mapping_params parse_rmappings_args(int argc, char ** argv);
 
+void process_bamfile( const string & bamfile, output_files & of );
+
+//Part i of an output file prefix, for the i-th of several BAM files
+string part_base( const string & base, const size_t & i )
+{
+  return base + ".part" + to_string(i);
+}
+
+/*
+  Append the part files to fn, in order, and remove them.
+  A concatenation of gzip files is itself a valid gzip file, and is
+  read by zlib as if it were one stream.
+*/
+void concatenate_parts( const string & fn, const vector<string> & parts )
+{
+  FILE * out = fopen(fn.c_str(),"wb");
+  if( out == NULL )
+    {
+      cerr << "Error, could not open " << fn
+	   << " for writing\n";
+      exit(1);
+    }
+  vector<char> buffer(1<<20);
+  for( const auto & part : parts )
+    {
+      FILE * in = fopen(part.c_str(),"rb");
+      if( in == NULL )
+	{
+	  cerr << "Error, could not open " << part
+	       << " for reading\n";
+	  exit(1);
+	}
+      size_t n;
+      while( (n = fread(buffer.data(),1,buffer.size(),in)) > 0 )
+	{
+	  if( fwrite(buffer.data(),1,n,out) != n )
+	    {
+	      cerr << "Error: write error encountered at line " << __LINE__
+		   << " of " << __FILE__ << '\n';
+	      exit(1);
+	    }
+	}
+      fclose(in);
+      remove(part.c_str());
+    }
+  fclose(out);
+}
+
 int process_readmappings_main(int argc, char ** argv)
 {
   process_mapping_params pars = parse_rmappings_args(argc, argv);
-  struct output_files of(pars.structural_base.c_str(),pars.um_base.c_str());
-  
-  bamreader reader(pars.bamfile.c_str());
+
+  if( pars.bamfiles.size() == 1 )
+    {
+      output_files of(pars.structural_base.c_str(),pars.um_base.c_str());
+      process_bamfile(pars.bamfiles[0],of);
+      return 0;
+    }
+
+  /*
+    Read pairs do not span BAM files (e.g., one file per lane),
+    so each file is processed on its own, by one of pars.nthreads
+    workers, into its own set of part files.  The parts are then
+    joined in input order, giving the same output as if the files
+    had been processed one after the other.
+  */
+  const size_t nfiles = pars.bamfiles.size();
+  atomic<size_t> next(0);
+  auto worker = [&]() {
+    for( size_t i = next++ ; i < nfiles ; i = next++ )
+      {
+	output_files of(part_base(pars.structural_base,i).c_str(),
+			part_base(pars.um_base,i).c_str());
+	process_bamfile(pars.bamfiles[i],of);
+      }
+  };
+  vector<thread> threads;
+  for( unsigned t = 1 ; t < min(size_t(pars.nthreads),nfiles) ; ++t ) threads.emplace_back(worker);
+  worker();
+  for( auto & t : threads ) t.join();
+
+  const auto outputs = output_files::filenames(pars.structural_base,pars.um_base);
+  vector<vector<string> > parts(outputs.size());
+  for( size_t i = 0 ; i < nfiles ; ++i )
+    {
+      const auto p = output_files::filenames(part_base(pars.structural_base,i),
+					     part_base(pars.um_base,i));
+      for( size_t j = 0 ; j < p.size() ; ++j ) parts[j].push_back(p[j]);
+    }
+  for( size_t j = 0 ; j < outputs.size() ; ++j ) concatenate_parts(outputs[j],parts[j]);
+  return 0;
+}
+
+void process_bamfile( const string & bamfile, output_files & of )
+{
+  bamreader reader(bamfile.c_str());
 
   if ( ! reader ) {
-    cerr << "Error: " << pars.bamfile 
+    cerr << "Error: " << bamfile 
 	 << " could not be opened for reading\n";
     exit(1);
   }
@@ -259,7 +360,6 @@ int process_readmappings_main(int argc, char ** argv)
 	    }
 	}
     }
-  return 0;
 }
 
 process_mapping_params parse_rmappings_args(int argc, char ** argv)
@@ -268,7 +368,8 @@ process_mapping_params parse_rmappings_args(int argc, char ** argv)
   options_description desc("pecnv process: collect unusual paired-end mappings from a bam file");
   desc.add_options()
     ("help,h", "Produce help message")
-    ("bamfile,b",value<string>(&rv.bamfile),"BAM file name (required)")
+    ("bamfile,b",value<vector<string> >(&rv.bamfiles)->multitoken(),"BAM file name(s) (required).  Read pairs must not be split across files, e.g. give one file per lane.  The output is the same as if the files were processed one after the other")
+    ("threads,t",value<unsigned>(&rv.nthreads)->default_value(0),"Number of BAM files to process at once.  Default (0) is all of them")
     ("structural,s",value<string>(&rv.structural_base),"Prefix for output files names for divergent, parallel, unlinked reads (required)")
     ("umulti,u",value<string>(&rv.um_base),"Prefix for output file names for unique/repetitive read pairs")
     ;
@@ -287,15 +388,16 @@ process_mapping_params parse_rmappings_args(int argc, char ** argv)
       exit(0);
     }
 
-  if( vm.count("bamfile") )
+  for( const auto & bamfile : rv.bamfiles )
     {
-      if (!file_exists(rv.bamfile.c_str()))
+      if (!file_exists(bamfile.c_str()))
 	{
 	  cerr << "Error: "
-	       << rv.bamfile
+	       << bamfile
 	       << " does not exist\n";
 	}
     }
+  if( rv.nthreads == 0 ) rv.nthreads = unsigned(rv.bamfiles.size());
 
   return rv;
 }
@@ -0,0 +1,6 @@
+#ifndef __PECNV_QTILE_HPP__
+#define __PECNV_QTILE_HPP__
+
+int insert_qtile_main( int argc, char ** argv );
+
+#endif
@@ -11,6 +11,10 @@
 #include <limits>
 #include <cassert>
 #include <sstream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <zlib.h>
 #include <common.hpp>
 #include <Sequence/IOhelp.hpp>
@@ -20,7 +24,10 @@
 #include <teclust_parseargs.hpp>
 #include <teclust_scan_bamfile.hpp>
 #include <teclust_phrapify.hpp>
+#include <teclust_batch.hpp>
 #include <intermediateIO.hpp>
+#include <chromdict.hpp>
+#include <nameset.hpp>
 
 using namespace std;
 using namespace Sequence;
@@ -30,9 +37,10 @@ using puu = pair<int32_t,int8_t>;
 const unsigned IMAX = std::numeric_limits<int32_t>::max();
 
 refTEcont read_refdata( const teclust_params & p );
-unordered_set<string> procUMM(const teclust_params & pars,
-			      const refTEcont & reftes,
-			      map<string,vector< puu > > * data);
+nameset procUMM(const teclust_params & pars,
+		const refTEcont & reftes,
+		vector<vector< puu > > * data,
+		chromdict * chroms);
 /*
 //Old version, prior to bedpe output
 void output_results(ostringstream & out,
@@ -40,65 +48,69 @@ void output_results(ostringstream & out,
 		    const string & chrom_label, 
 		    const refTEcont & reftes);
 */
+vector<clusteredEvent> annotate_clusters(const vector<pair<cluster,cluster> > & clusters, 
+					 const string & chrom_label, 
+					 const refTEcont & reftes);
 void output_results_bedpe(ostringstream & out,
-			  const vector<pair<cluster,cluster> > & clusters, 
-			  const string & chrom_label, 
-			  const string & samplename,
-			  const refTEcont & reftes);
+			  const vector<clusteredEvent> & events,
+			  const string & samplename);
 void cluster_data( vector<pair<cluster,cluster> > & clusters,
 		   const vector<puu> & raw_data, 
 		   const int32_t & INSERTSIZE, const int32_t & MDIST );
 void reduce_ends( vector<cluster> & clusters,
 		  const int32_t & INSERTSIZE );
+void teclust_sample( const teclust_params & pars,
+		     const refTEcont & refTEs );
 
 int teclust_main( int argc, char ** argv )
 {
   const teclust_params pars = teclust_parseargs(argc,argv);
 
   //Read in the locations of TEs in the reference
-  auto refTEs = read_refdata(pars);
+  const auto refTEs = read_refdata(pars);
+  if( pars.manifest.empty() )
+    {
+      teclust_sample(pars,refTEs);
+    }
+  else
+    {
+      //All samples share refTEs, which is only read from here on
+      teclust_batch(pars,read_teclust_manifest(pars),
+		    [&refTEs](const teclust_params & sample) {
+		      teclust_sample(sample,refTEs);
+		    });
+    }
+  return 0;
+}
+
+//Cluster one sample, given the reference TEs
+void teclust_sample( const teclust_params & pars,
+		     const refTEcont & refTEs )
+{
   /*
     Process the um_u and um_m files from the sample.  if refTEs is empty, parsedUMM contains the info for all U/M pairs.
     Otherwise, it contains only the info from U/M pairs where the M read hits a known TE in the reference.
   */
-  //rawData = map {chromo x vector {start,strand}}
-  map<string,vector< puu > > rawData;
-  unordered_set<string> readPairs = procUMM(pars,refTEs,&rawData);
+  //rawData = vector {chromo id x vector {start,strand}}, ids are from chroms
+  vector<vector< puu > > rawData;
+  chromdict chroms;
+  nameset readPairs = procUMM(pars,refTEs,&rawData,&chroms);
+  //Most reads in the BAM file are not in readPairs, and the filter rejects them cheaply
+  if( !pars.bamfile.empty() ) readPairs.build_filter();
   /*
     Scan the BAM file to look for reads whose
     primary alignment hits a known TE in
     the reference, and whose mate is 
     mapped but does not hit a TE
   */
-  scan_bamfile(pars,refTEs,&readPairs,&rawData);
-  //Sort the raw data
-  for( auto itr = rawData.begin();itr!=rawData.end();++itr )
-    {
-      sort(itr->second.begin(),itr->second.end(),
-	   [](const puu & lhs, const puu & rhs) {
-	     return lhs.first < rhs.first;
-	   });
-    }
-
+  scan_bamfile(pars,refTEs,&readPairs,&rawData,&chroms);
 
-  if( rawData.empty() )
+  if( find_if(rawData.cbegin(),rawData.cend(),[](const vector<puu> & __v) { return !__v.empty(); }) == rawData.cend() )
     {
-      cerr << "No data found. Exiting.\n";
-      exit(0);
+      if( pars.manifest.empty() ) cerr << "No data found. Exiting.\n";
+      else cerr << "No data found for sample " << pars.samplename << '\n';
+      return;
     }
-  //Cluster the raw data and buffer results
-  ostringstream out;
-  for( auto itr = rawData.begin() ; itr != rawData.end(); ++itr)
-    {
-      vector<pair<cluster,cluster> > clusters;
-      cluster_data(clusters,itr->second,pars.INSERTSIZE,pars.MDIST);
-      output_results_bedpe(out,clusters,
-			   itr->first,
-			   pars.samplename,
-			   refTEs);
-    }
-
-  //write output
   gzFile gzout = gzopen(pars.outfile.c_str(),"w");
   if(gzout == NULL) 
     {
@@ -107,66 +119,112 @@ int teclust_main( int argc, char ** argv )
 	   << " could not be opened for writing.\n";
       exit(1);
     }
-  if(! gzwrite(gzout,out.str().c_str(),unsigned(out.str().size())) )
+
+  /*
+    Cluster the raw data, and write the results in order of chromosome name.
+    Chromosomes are independent, so pars.nthreads threads take them
+    one at a time, each making that chromosome's events and output text.
+    Each chromosome is written, and its buffer freed, as soon as it and
+    all chromosomes before it are done.
+  */
+  vector<int32_t> ids;
+  for( auto id : chroms.sorted_ids() )
     {
-      cerr << "Error: gzwrite error at line " << __LINE__
-	   << " of " << __FILE__ << '\n';
-      exit(10);
+      if( unsigned(id) < rawData.size() && !rawData[id].empty() ) ids.push_back(id);
     }
-  gzclose(gzout);
-
-  //Output the input to phrap, if desired
-  phrapify( pars, out.str() );
-
-  return 0;
-}
-
-refTEcont read_refdata( const teclust_params & p )
-{
-  refTEcont rv;
-  
-  if(p.reference_datafile.empty()) return rv;
-  
-  gzFile in = gzopen(p.reference_datafile.c_str(),"r");
-  if(in == NULL )
+  const bool keepEvents = phrapify_wanted(pars);
+  vector<vector<clusteredEvent> > events(ids.size());
+  vector<string> buffers(ids.size());
+  vector<short> done(ids.size(),0);
+  mutex donemutex;
+  condition_variable donecv;
+  auto process = [&](const size_t & i) {
+    //Sort the raw data
+    vector<puu> & raw = rawData[ids[i]];
+    sort(raw.begin(),raw.end(),
+	 [](const puu & lhs, const puu & rhs) {
+	   return lhs.first < rhs.first;
+	 });
+    vector<pair<cluster,cluster> > clusters;
+    cluster_data(clusters,raw,pars.INSERTSIZE,pars.MDIST);
+    vector<puu>().swap(raw);
+    events[i] = annotate_clusters(clusters,chroms.name(ids[i]),refTEs);
+    ostringstream o;
+    output_results_bedpe(o,events[i],pars.samplename);
+    buffers[i] = o.str();
+    if(!keepEvents) vector<clusteredEvent>().swap(events[i]);
+  };
+  auto write = [&](const size_t & i) {
+    if( !buffers[i].empty() &&
+	! gzwrite(gzout,buffers[i].c_str(),unsigned(buffers[i].size())) )
+      {
+	cerr << "Error: gzwrite error at line " << __LINE__
+	     << " of " << __FILE__ << '\n';
+	exit(10);
+      }
+    string().swap(buffers[i]);
+  };
+  const unsigned nthreads = unsigned(min(size_t(pars.nthreads),ids.size()));
+  if( nthreads <= 1 )
     {
-      cerr << "Error: could not open " 
-	   << p.reference_datafile
-	   << " for reading\n";
-      exit(0);
+      for( size_t i = 0 ; i < ids.size() ; ++i )
+	{
+	  process(i);
+	  write(i);
+	}
     }
-
-  do
+  else
     {
-      auto line = IOhelp::gzreadline(in);
-      if(!line.second) break;
-      istringstream instream(line.first);
-      string chrom;
-      unsigned start,stop;
-      instream >> chrom >> start >> stop >> ws;
-      //The input file is BED, so start is 0 offset,
-      //and stop is 1 offset.  Thus, we 
-      //subtract 1 from stop to make both 0 offset
-      rv[chrom].emplace_back( teinfo(start,stop-1) );
+      atomic<size_t> next(0);
+      auto worker = [&]() {
+	for( size_t i = next++ ; i < ids.size() ; i = next++ )
+	  {
+	    process(i);
+	    lock_guard<mutex> lock(donemutex);
+	    done[i] = 1;
+	    donecv.notify_one();
+	  }
+      };
+      vector<thread> threads;
+      for( unsigned t = 0 ; t < nthreads ; ++t ) threads.emplace_back(worker);
+      for( size_t i = 0 ; i < ids.size() ; ++i )
+	{
+	  {
+	    unique_lock<mutex> lock(donemutex);
+	    donecv.wait(lock,[&]() { return done[i] != 0; });
+	  }
+	  write(i);
+	}
+      for( auto & t : threads ) t.join();
     }
-  while(!gzeof(in));
-
-  gzclose(in);
+  gzclose(gzout);
 
-  //Sort the data
-  for( auto __v = rv.begin() ; __v != rv.end() ; ++__v )
+  //Output the input to phrap, if desired
+  if( keepEvents )
     {
-      sort(__v->second.begin(),__v->second.end(),[](const teinfo & __l,const teinfo __r) {
-	  return __l.start() < __r.start();
-	});
+      vector<clusteredEvent> all;
+      for( auto & e : events )
+	{
+	  all.insert(all.end(),e.begin(),e.end());
+	  vector<clusteredEvent>().swap(e);
+	}
+      phrapify( pars, all );
     }
-  return rv;
+}
+
+refTEcont read_refdata( const teclust_params & p )
+{
+  if(p.reference_datafile.empty()) return refTEcont();
+  //An index made by pecnv teindex is used in place.  A BED file is parsed and indexed.
+  if(is_teindex(p.reference_datafile.c_str())) return map_teindex(p.reference_datafile.c_str());
+  return read_te_bed(p.reference_datafile.c_str());
 }
 
 
-unordered_set<string> procUMM(const teclust_params & pars,
-			      const refTEcont & reftes,
-			      map<string,vector< puu > > * data)
+nameset procUMM(const teclust_params & pars,
+		const refTEcont & reftes,
+		vector<vector< puu > > * data,
+		chromdict * chroms)
 {
   gzFile gzin = gzopen(pars.ummfile.c_str(),"r" );
   if(gzin == NULL)
@@ -177,7 +235,7 @@ unordered_set<string> procUMM(const teclust_params & pars,
       exit(1);
     }
 
-  unordered_set<string> mTE; //"M" reads that map to a known TE in the refernce.  
+  nameset mTE; //"M" reads that map to a known TE in the refernce.  
 
   if (!reftes.empty() )
     {
@@ -202,7 +260,7 @@ unordered_set<string> procUMM(const teclust_params & pars,
 	    }
 	  alnInfo alndata(gzin);
 	  //Don't re-process a read if we already know it has a mapping to a TE
-	  if( mTE.find(name.first) == mTE.end() )
+	  if( !mTE.contains(name.first) )
 	    {
 	      auto __itr = reftes.find(chrom.first);
 	      if( __itr != reftes.end() )
@@ -213,12 +271,7 @@ unordered_set<string> procUMM(const teclust_params & pars,
 		      mTE.insert(name.first);
 		    }
 		  //Else, require that an M read overlap a TE
-		  else if( find_if(__itr->second.cbegin(),
-				   __itr->second.cend(),
-				   [&](const teinfo & __t) {
-				     return ( (alndata.start >= __t.start() && alndata.start <= __t.stop()) ||
-					      (alndata.stop >= __t.start() && alndata.stop <= __t.stop()) );
-				   }) != __itr->second.cend() )
+		  else if( __itr->second.hits(alndata.start,alndata.stop) )
 		    {
 		      //Then read hits a known TE
 		      mTE.insert(name.first);
@@ -261,17 +314,11 @@ unordered_set<string> procUMM(const teclust_params & pars,
 	  exit(1);
 	}
       alnInfo alndata(gzin);
-      if( reftes.empty() || (!reftes.empty() && mTE.find(name.first) != mTE.end()) )
+      if( reftes.empty() || (!reftes.empty() && mTE.contains(name.first)) )
 	{
-	  auto itr = data->find(chrom.first);
-	  if( itr == data->end() )
-	    {
-	      data->insert(make_pair(chrom.first,vector<puu>(1,make_pair(alndata.start,alndata.strand))));
-	    }
-	  else
-	    {
-	      itr->second.push_back(make_pair(alndata.start,alndata.strand));
-	    }
+	  const int32_t id = chroms->id(chrom.first);
+	  if( unsigned(id) >= data->size() ) data->resize(id+1);
+	  (*data)[id].push_back(make_pair(alndata.start,alndata.strand));
 	}
     }
   while(!gzeof(gzin));
@@ -280,108 +327,62 @@ unordered_set<string> procUMM(const teclust_params & pars,
 }
 
 
+/*
+  raw_data must be sorted by position.  Each strand is clustered in one
+  sweep, and the plus and minus clusters are then paired up by walking
+  both lists in order, so the run time is linear in the number of reads
+  and clusters.
+*/
 void cluster_data( vector<pair<cluster,cluster> > & clusters,
 		   const vector<puu> & raw_data, 
 		   const int32_t & INSERTSIZE, const int32_t & MDIST )
 {
+  /*
+    A read joins the last cluster on its strand if it is within INSERTSIZE
+    of the cluster's last read, and otherwise starts a new one.
+    Because the reads are sorted, no earlier cluster can be within
+    INSERTSIZE of a read that did not join the last one.
+  */
   vector<cluster> plus,minus;
   for( unsigned i=0;i<raw_data.size();++i )
     {
-      if (raw_data[i].second == 0)
+      vector<cluster> & strand = (raw_data[i].second == 0) ? plus : minus;
+      if( !strand.empty() && raw_data[i].first - strand.back().positions.second <= INSERTSIZE )
 	{
-	  if(plus.empty())
-	    {
-	      plus.push_back( cluster(raw_data[i].first,raw_data[i].first,1) );
-	    }
-	  else
-	    {
-	      bool clustered=false;
-	      for(unsigned j=0;!clustered&&j<plus.size();++j)
-		{
-		  if( (max(raw_data[i].first,plus[j].positions.second)-
-		       min(raw_data[i].first,plus[j].positions.second)) <= INSERTSIZE )
-		    {
-		      assert( raw_data[i].first >= plus[j].positions.second );
-		      plus[j].positions.second = raw_data[i].first;
-		      plus[j].nreads++;
-		      clustered=true;
-		    }
-
-		}
-	      if(!clustered)
-		{
-		  plus.push_back( cluster(raw_data[i].first,raw_data[i].first,1) );
-		}
-	    }
+	  assert( raw_data[i].first >= strand.back().positions.second );
+	  strand.back().positions.second = raw_data[i].first;
+	  strand.back().nreads++;
 	}
-      else //minus strand works same as plus strand
+      else
 	{
-	  if( minus.empty() )
-	    {
-	      minus.push_back( cluster(raw_data[i].first,raw_data[i].first,1) );
-	    }
-	  else
-	    {
-	      bool clustered=false;
-	      for(unsigned j=0;!clustered&&j<minus.size();++j)
-		{
-		  if( (max(raw_data[i].first,minus[j].positions.second)-
-		       min(raw_data[i].first,minus[j].positions.second)) <= INSERTSIZE )
-		    {
-		      assert( raw_data[i].first >= minus[j].positions.second );
-		      minus[j].positions.second = raw_data[i].first;
-		      minus[j].nreads++;
-		      clustered=true;
-		    }
-		  
-		}
-	      if(!clustered)
-		{
-		  minus.push_back( cluster(raw_data[i].first,raw_data[i].first,1) );
-		}
-	    }
+	  strand.push_back( cluster(raw_data[i].first,raw_data[i].first,1) );
 	}
     }
   
   reduce_ends( plus, INSERTSIZE );
   reduce_ends( minus, INSERTSIZE );
 
-  auto close_enough_minus = [](const cluster & __minus,
-			       const cluster & __plus,
-			       const int32_t & __MDIST)
-    {
-      if( __minus.positions.first < __plus.positions.second ) return false;
-      if( __minus.positions.first - __plus.positions.second <= __MDIST) return true;
-      return false;
-    };
-
-  //now, we have to match up plus and minus based on MDIST
-  vector<short> matched(plus.size(),0);
+  /*
+    now, we have to match up plus and minus based on MDIST.
+    A plus cluster is matched with the first minus cluster starting at or after its end,
+    if that is within MDIST.  If a later plus cluster ends closer to that minus cluster,
+    the closest one (the last ending at or before it) wins the match instead.
+    Both lists are sorted, so the minus cluster and the winner are found by moving
+    forward through the lists.
+  */
+  vector<short> matched(plus.size(),0),used(minus.size(),0);
+  size_t mi = 0, winner = 0;
   for(unsigned i=0;i<plus.size();++i)
     {
       if(!matched[i])
 	{
-	  vector<cluster>::iterator j = find_if(minus.begin(),
-						minus.end(),
-						bind(close_enough_minus,placeholders::_1,plus[i],MDIST));
-	  if( j != minus.end() )
+	  while( mi < minus.size() && (used[mi] || minus[mi].positions.first < plus[i].positions.second) ) ++mi;
+	  if( mi < minus.size() && minus[mi].positions.first - plus[i].positions.second <= MDIST )
 	    {
-	      //is there a better match in plus for this minus?
-	      auto dist = j->positions.first-plus[i].positions.second;
-	      unsigned winner = i;
-	      for(unsigned k=i+1;k<plus.size();++k)
-		{
-		  if( close_enough_minus(*j,plus[k],MDIST) )
-		    {
-		      if( j->positions.first - plus[k].positions.second < dist )
-			{
-			  dist = j->positions.first - plus[k].positions.second;
-			  winner=k;
-			}
-		    }
-		}
-	      clusters.push_back( make_pair(plus[winner],*j) );
-	      minus.erase(j);
+	      winner = max(winner,size_t(i));
+	      while( winner+1 < plus.size() && plus[winner+1].positions.second <= minus[mi].positions.first ) ++winner;
+	      clusters.push_back( make_pair(plus[winner],minus[mi]) );
+	      used[mi]=1;
 	      matched[winner]=1;
 	      //need to take care of i, too, if i no longer matches
 	      if(winner!=i)
@@ -398,47 +399,27 @@ void cluster_data( vector<pair<cluster,cluster> > & clusters,
 	}
     }
 
-  //now, add in the minuses
+  /*
+    now, add in the minuses.  Each goes before the first event
+    with a cluster starting after it.  The minuses are in order,
+    so each goes at or after the place of the one before.
+  */
+  auto start_after = [](const pair<cluster,cluster> & __c, const int32_t & __pos)
+    {
+      if( __c.first.positions.first != IMAX && __pos < __c.first.positions.first ) return true;
+      return ( __c.second.positions.first != IMAX && __pos < __c.second.positions.first );
+    };
+  vector<pair<cluster,cluster> > merged;
+  merged.reserve(clusters.size()+minus.size());
+  auto next = clusters.begin();
   for( unsigned i = 0 ; i < minus.size() ; ++i  )
     {
-      bool pushed = false;
-      for(long unsigned j = 0 ; j < clusters.size() ; ++j )
-	{
-	  if( clusters[j].first.positions.first != IMAX )
-	    {
-	      if( minus[i].positions.first < clusters[j].first.positions.first )
-		{
-		  //add it
-		  pushed=true;
-		  clusters.insert(clusters.begin()+j,make_pair(cluster(),minus[i]));
-		  j=clusters.size();
-		}
-	      else if ( clusters[j].second.positions.first != IMAX )
-		{
-		  if( minus[i].positions.first <  clusters[j].second.positions.first )
-		    {
-		      pushed=true;
-		      clusters.insert(clusters.begin()+j,make_pair(cluster(),minus[i]));
-		      j=clusters.size();
-		    }
-		}
-	    }
-	  else if( clusters[j].second.positions.first != IMAX )
-	    {
-	      assert( clusters[j].second.positions.first != IMAX );
-	      if( minus[i].positions.first < clusters[j].second.positions.first )
-		{
-		  pushed=true;
-		  clusters.insert(clusters.begin()+j,make_pair(cluster(),minus[i]));
-		  j=clusters.size();
-		}
-	    }
-	}
-      if(!pushed)
-	{
-	  clusters.push_back(make_pair(cluster(),minus[i]));
-	}
+      if(used[i]) continue;
+      for( ; next != clusters.end() && !start_after(*next,minus[i].positions.first) ; ++next ) merged.push_back(*next);
+      merged.push_back(make_pair(cluster(),minus[i]));
     }
+  merged.insert(merged.end(),next,clusters.end());
+  clusters.swap(merged);
 }
 
 /*
@@ -538,156 +519,155 @@ void output_results( ostringstream & out,
 }
 */
 
-void output_results_bedpe( ostringstream & out,
-			   const vector<pair<cluster,cluster> > & clusters, 
-			   const string & chrom_label , 
-			   const string & samplename,
-			   const refTEcont & reftes )
+vector<clusteredEvent> annotate_clusters( const vector<pair<cluster,cluster> > & clusters, 
+					  const string & chrom_label , 
+					  const refTEcont & reftes )
 {
-  out.flush();
-
-  auto closest_plus = [](const teinfo & __t,
-			 const int32_t & rhs)
-    {
-      return  (__t.start() >= rhs || ( rhs >= __t.start() && rhs <= __t.stop() ) );
-    };
-
-  auto closest_minus = [](const teinfo & __t,
-			  const int32_t & rhs)
-    {
-      return (__t.start() <= rhs || ( rhs >= __t.start() && rhs <= __t.stop() ) );
-    };
-
-  auto within = [](const teinfo & __t, const int32_t & start, const int32_t & stop)
-    {
-      bool A = start >= __t.start() && start <= __t.stop();
-      bool B = stop>= __t.start() && stop <= __t.stop();
-      return A||B;
-    };
-
+  //A chromosome with no TEs has an empty index
+  static const teintervals noTEs;
   auto refItr = reftes.find(chrom_label);
+  const teintervals & chromTEs = (refItr == reftes.end()) ? noTEs : refItr->second;
+  vector<clusteredEvent> events;
+  events.reserve(clusters.size());
   for(unsigned i=0;i<clusters.size();++i)
     {
-      ostringstream xtra; //for the optional column
-      xtra << clusters[i].first.nreads
-	   << '\t'
-	   << clusters[i].second.nreads 
-	   << '\t';
+      clusteredEvent e;
+      e.chrom = chrom_label;
+      e.nplus = clusters[i].first.nreads;
+      e.nminus = clusters[i].second.nreads;
       if( clusters[i].first.positions.first == IMAX )
 	{
-	  //Chrom, start, stop, unknown.
-	  out << ".\t"
-	      << "-1\t"
-	      << "-1\t";
-	  xtra << "-1\t-1\t";
+	  e.pfirst = e.plast = e.pdist = e.pin = -1;
 	}
       else
 	{
-	  out << chrom_label << '\t'
-	      << clusters[i].first.positions.first << '\t'
-	      << clusters[i].first.positions.second + 1 << '\t';
+	  e.pfirst = clusters[i].first.positions.first;
+	  e.plast = clusters[i].first.positions.second;
 	  int mindist = -1;
 	  int withinTE = -1;
 	  if(!reftes.empty())
 	    {
-	      auto mind = find_if( refItr->second.cbegin(), refItr->second.cend(),
-				   bind(closest_plus,placeholders::_1,clusters[i].first.positions.second) );
-	      if(mind != refItr->second.end())
+	      auto mind = chromTEs.first_from(clusters[i].first.positions.second);
+	      if(mind != nullptr)
 		{
 		  mindist = (mind->start() < clusters[i].first.positions.first) ?
 		    clusters[i].first.positions.first-mind->start() : 
 		    mind->start() - clusters[i].first.positions.first;
 		}
-	      auto __win = find_if(refItr->second.cbegin(),refItr->second.cend(),
-				   bind(within,placeholders::_1,clusters[i].first.positions.first,clusters[i].first.positions.second));
-	      withinTE = ( __win != refItr->second.cend() );
+	      withinTE = chromTEs.hits(clusters[i].first.positions.first,clusters[i].first.positions.second);
 	    }
-	  xtra << ((withinTE) ? 0 : mindist) << '\t' << withinTE << '\t';
+	  e.pdist = (withinTE) ? 0 : mindist;
+	  e.pin = withinTE;
 	}
       if( clusters[i].second.positions.first == IMAX )
 	{
-	  out << ".\t"
-	      << "-1\t"
-	      << "-1\t";
-	  xtra << "-1\t-1";
+	  e.mfirst = e.mlast = e.mdist = e.min = -1;
 	}
       else
 	{
-	  out << chrom_label << '\t'
-	      << clusters[i].second.positions.first << '\t'
-	      << clusters[i].second.positions.second + 1 << '\t';
+	  e.mfirst = clusters[i].second.positions.first;
+	  e.mlast = clusters[i].second.positions.second;
 	  int mindist = -1;
 	  int withinTE = -1;
 	  if(!reftes.empty())
 	    {
-	      auto mindr = find_if(refItr->second.crbegin(),
-				   refItr->second.crend(),
-				   bind(closest_minus,placeholders::_1,clusters[i].second.positions.first));
-	      if(mindr != refItr->second.crend())
+	      auto mindr = chromTEs.last_before(clusters[i].second.positions.first);
+	      if(mindr != nullptr)
 		{
 		  mindist = (mindr->start() < clusters[i].second.positions.second) ? 
 		    clusters[i].second.positions.second-mindr->start() : mindr->start() - clusters[i].second.positions.second;
 		}
-	      auto __win = find_if(refItr->second.cbegin(),refItr->second.cend(),
-				   bind(within,placeholders::_1,clusters[i].second.positions.first,clusters[i].second.positions.second));
-	      withinTE = (__win != refItr->second.cend());
+	      withinTE = chromTEs.hits(clusters[i].second.positions.first,clusters[i].second.positions.second);
 	    }
-	  xtra << ((withinTE) ? 0 : mindist) << '\t' << withinTE;// << endl;
+	  e.mdist = (withinTE) ? 0 : mindist;
+	  e.min = withinTE;
+	}
+      events.push_back(std::move(e));
+    }
+  return events;
+}
+
+void output_results_bedpe( ostringstream & out,
+			   const vector<clusteredEvent> & events,
+			   const string & samplename )
+{
+  for(unsigned i=0;i<events.size();++i)
+    {
+      const clusteredEvent & e = events[i];
+      if( e.pfirst == -1 )
+	{
+	  //Chrom, start, stop, unknown.
+	  out << ".\t"
+	      << "-1\t"
+	      << "-1\t";
 	}
-      out << samplename << "_" << chrom_label << "_event" << i << '\t'         //This is the "name" column in the bedpe
-	  <<  log10(clusters[i].first.nreads+clusters[i].second.nreads) << '\t'
+      else
+	{
+	  out << e.chrom << '\t'
+	      << e.pfirst << '\t'
+	      << e.plast + 1 << '\t';
+	}
+      if( e.mfirst == -1 )
+	{
+	  out << ".\t"
+	      << "-1\t"
+	      << "-1\t";
+	}
+      else
+	{
+	  out << e.chrom << '\t'
+	      << e.mfirst << '\t'
+	      << e.mlast + 1 << '\t';
+	}
+      out << samplename << "_" << e.chrom << "_event" << i << '\t'         //This is the "name" column in the bedpe
+	  <<  log10(e.nplus+e.nminus) << '\t'
 	  << "+\t-\t"
-	  << xtra.str() << '\n';
-      out.flush();
+	  << e.nplus << '\t' << e.nminus << '\t' //the optional columns
+	  << e.pdist << '\t' << e.pin << '\t'
+	  << e.mdist << '\t' << e.min << '\n';
     }
 }
 
+/*
+  Merge clusters whose ends are within INSERTSIZE of one another.
+  clusters must be sorted by position, as made by cluster_data,
+  so that the nearest earlier cluster to each one is the one before it.
+  They are merged from the last one back in a single pass.
+*/
 void reduce_ends( vector<cluster> & clusters,
 		  const int32_t & INSERTSIZE )
 {
-  vector<cluster>::iterator i = clusters.end()-1,
-    beg = clusters.begin(),j;
-
-  while(i-clusters.begin() > 0)
+  auto close = [&INSERTSIZE](const cluster & i, const cluster & j) {
+    if( i.positions.first == IMAX || j.positions.first == IMAX ) return false;
+    return ( (( max(i.positions.first,j.positions.first) -
+		min(i.positions.first,j.positions.first) ) <= INSERTSIZE ) ||
+	     (( max(i.positions.first,j.positions.second) -
+		min(i.positions.first,j.positions.second) ) <= INSERTSIZE ) ||
+	     (( max(i.positions.second,j.positions.second) -
+		min(i.positions.second,j.positions.second) ) <= INSERTSIZE ) ||
+	     (( max(i.positions.second,j.positions.first) -
+		min(i.positions.second,j.positions.first) ) <= INSERTSIZE ) );
+  };
+  if( clusters.size() < 2 ) return;
+  //kept is filled from the back of clusters, with last the one that may still merge into an earlier one
+  vector<cluster> kept;
+  cluster last = clusters.back();
+  for( auto j = clusters.rbegin()+1 ; j != clusters.rend() ; ++j )
     {
-      bool merged = 0;
-      assert(i>beg);
-      for( j = i-1 ; !merged && j>=clusters.begin() ; --j )
+      if( close(last,*j) )
 	{
-	  assert(j<i);
-	  assert(j>=beg);
-	  assert(beg==clusters.begin());
-	  assert( i-beg > 0);
-	  if( i->positions.first != IMAX && j->positions.first != IMAX )
-	    {
-	      assert(j-beg>=0);
-	      if( (( max(i->positions.first,j->positions.first) -
-		     min(i->positions.first,j->positions.first) ) <= INSERTSIZE ) ||
-		  (( max(i->positions.first,j->positions.second) -
-		     min(i->positions.first,j->positions.second) ) <= INSERTSIZE ) ||
-		  (( max(i->positions.second,j->positions.second) -
-		     min(i->positions.second,j->positions.second) ) <= INSERTSIZE ) ||
-		  (( max(i->positions.second,j->positions.first) -
-		     min(i->positions.second,j->positions.first) ) <= INSERTSIZE ) )
-		{
-		  j->positions.first = min(i->positions.first,
-					   j->positions.first);
-		  j->positions.second = max(i->positions.second,
-					    j->positions.second);
-		  j->nreads++;
-		  clusters.erase(i);
-		  i=clusters.end()-1;
-		  j=i-1;
-		  beg=clusters.begin();
-		  merged=true;
-		}
-	    }
+	  j->positions.first = min(last.positions.first,
+				   j->positions.first);
+	  j->positions.second = max(last.positions.second,
+				    j->positions.second);
+	  j->nreads++;
 	}
-      if(!merged)
+      else
 	{
-	  --i;
+	  kept.push_back(last);
 	}
+      last = *j;
     }
+  kept.push_back(last);
+  clusters.assign(kept.rbegin(),kept.rend());
 }
-
-
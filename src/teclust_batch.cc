@@ -0,0 +1,158 @@
+#include <teclust_batch.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+vector<teclust_params> read_teclust_manifest( const teclust_params & pars )
+{
+  ifstream in(pars.manifest.c_str());
+  if(!in)
+    {
+      cerr << "Error: could not open "
+	   << pars.manifest
+	   << " for reading\n";
+      exit(1);
+    }
+  vector<teclust_params> rv;
+  string line;
+  unsigned lineno = 0;
+  while( getline(in,line) )
+    {
+      ++lineno;
+      istringstream fields(line);
+      string umu;
+      if( !(fields >> umu) || umu[0] == '#' ) continue;
+      teclust_params sample(pars);
+      sample.manifest.clear();
+      sample.umufile = umu;
+      if( !(fields >> sample.ummfile >> sample.bamfile >> sample.outfile) )
+	{
+	  cerr << "Error: line " << lineno << " of " << pars.manifest
+	       << " does not have the fields umufile ummfile bamfile outfile [sampleID]\n";
+	  exit(1);
+	}
+      if( sample.bamfile == "-" ) sample.bamfile.clear();
+      fields >> sample.samplename;
+      for( const string * f : { &sample.umufile, &sample.ummfile } )
+	{
+	  struct stat buf;
+	  if( stat(f->c_str(),&buf) == -1 )
+	    {
+	      cerr << "Error: " << *f
+		   << " does not exist (line " << lineno << " of "
+		   << pars.manifest << ")\n";
+	      exit(1);
+	    }
+	}
+      if( !pars.phrapdir.empty() ) sample.phrapdir = pars.phrapdir + '/' + sample.samplename;
+      rv.emplace_back(std::move(sample));
+    }
+  if( rv.empty() )
+    {
+      cerr << "Error: no samples found in " << pars.manifest << '\n';
+      exit(1);
+    }
+  //Samples must not write over each other's output
+  vector<string> outputs;
+  for( const auto & s : rv ) outputs.push_back(s.outfile);
+  if( !pars.phrapdir.empty() )
+    {
+      for( const auto & s : rv ) outputs.push_back(s.phrapdir);
+    }
+  sort(outputs.begin(),outputs.end());
+  auto dup = adjacent_find(outputs.begin(),outputs.end());
+  if( dup != outputs.end() )
+    {
+      cerr << "Error: " << *dup << " is used by more than one sample in "
+	   << pars.manifest << '\n';
+      exit(1);
+    }
+  return rv;
+}
+
+uint64_t teclust_memory_estimate( const teclust_params & sample )
+{
+  /*
+    The um_u and um_m files are gzipped text, and the reads and names
+    kept from them take several times their size on disk.  What is
+    kept from the BAM file is bounded by the reads near TEs, which are
+    usually far fewer.
+  */
+  uint64_t rv = 0;
+  for( const string * f : { &sample.umufile, &sample.ummfile } )
+    {
+      struct stat buf;
+      if( stat(f->c_str(),&buf) == 0 ) rv += uint64_t(buf.st_size);
+    }
+  return 10*rv;
+}
+
+void teclust_batch( const teclust_params & pars,
+		    const vector<teclust_params> & samples,
+		    const function<void(const teclust_params &)> & f )
+{
+  if( !pars.phrapdir.empty() )
+    {
+      //Each sample's phrap files go in a subdirectory of this one
+      int status = mkdir( pars.phrapdir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH );
+      if( status == -1 && errno != EEXIST )
+	{
+	  cerr << "Error: could not create directory "
+	       << pars.phrapdir
+	       << " at line " << __LINE__
+	       << " of " << __FILE__ << '\n';
+	  exit(1);
+	}
+    }
+
+  uint64_t budget = uint64_t(pars.maxmem * 1024. * 1024. * 1024.);
+  if( budget == 0 )
+    {
+      const long pages = sysconf(_SC_PHYS_PAGES), pagesize = sysconf(_SC_PAGE_SIZE);
+      budget = (pages > 0 && pagesize > 0) ? uint64_t(pages)*uint64_t(pagesize)/2 : 0;
+    }
+
+  mutex m;
+  condition_variable cv;
+  size_t next = 0;
+  unsigned running = 0;
+  uint64_t inuse = 0;
+  auto worker = [&]() {
+    while(true)
+      {
+	size_t i;
+	uint64_t need;
+	{
+	  unique_lock<mutex> lock(m);
+	  if( next == samples.size() ) return;
+	  i = next++;
+	  need = teclust_memory_estimate(samples[i]);
+	  //budget == 0 means the physical memory is unknown, so there is no limit
+	  cv.wait(lock,[&]() { return running == 0 || budget == 0 || inuse + need <= budget; });
+	  ++running;
+	  inuse += need;
+	}
+	f(samples[i]);
+	{
+	  lock_guard<mutex> lock(m);
+	  --running;
+	  inuse -= need;
+	}
+	cv.notify_all();
+      }
+  };
+  const unsigned njobs = unsigned(min(size_t(pars.njobs),samples.size()));
+  vector<thread> threads;
+  for( unsigned t = 1 ; t < njobs ; ++t ) threads.emplace_back(worker);
+  worker();
+  for( auto & t : threads ) t.join();
+}
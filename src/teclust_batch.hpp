@@ -0,0 +1,38 @@
+#ifndef __PECNV_TECLUST_BATCH_HPP__
+#define __PECNV_TECLUST_BATCH_HPP__
+
+#include <cstdint>
+#include <vector>
+#include <functional>
+#include <teclust_objects.hpp>
+
+/*
+  Batch mode for teclust: many samples, one set of reference TEs.
+
+  Each line of the manifest (pars.manifest) is one sample:
+  umufile ummfile bamfile outfile [sampleID]
+  bamfile is - if there is none, and sampleID defaults to pars.samplename.
+  Blank lines and lines starting with # are skipped.
+
+  Returns a copy of pars for each sample, in manifest order, with those
+  fields filled in.  If pars.phrapdir is set, each sample's phrap
+  input goes in pars.phrapdir/sampleID.
+  Exits with an error message if the manifest cannot be read.
+*/
+std::vector<teclust_params> read_teclust_manifest( const teclust_params & pars );
+
+//Rough upper bound on the memory (bytes) needed to process a sample
+std::uint64_t teclust_memory_estimate( const teclust_params & sample );
+
+/*
+  Calls f on each sample, with at most pars.njobs calls running at once.
+  A sample is only started when its teclust_memory_estimate, plus that
+  of those running, is within pars.maxmem, or if nothing else is running.
+  Samples are taken in manifest order, but one waiting for memory
+  may be passed by a later, smaller one.
+*/
+void teclust_batch( const teclust_params & pars,
+		    const std::vector<teclust_params> & samples,
+		    const std::function<void(const teclust_params &)> & f );
+
+#endif
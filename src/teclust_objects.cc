@@ -1,5 +1,6 @@
 #include <teclust_objects.hpp>
 #include <limits>
+#include <algorithm>
 #include <iostream>
 using namespace std;
 
@@ -10,12 +11,20 @@ teclust_params::teclust_params() : reference_datafile(string()),
 				   umufile(string()),
 				   ummfile(string()),
 				   phrapdir(string()),
+				   samplename(string()),
+				   manifest(string()),
 				   INSERTSIZE(numeric_limits<int32_t>::max()),
 				   MDIST(numeric_limits<int32_t>::max()),
 				   MINREADS(numeric_limits<int32_t>::max()),
 				   CLOSEST(-1),
+				   nthreads(1),
+				   njobs(1),
+				   maxreads(0),
+				   seed(0),
+				   maxmem(0.),
 				   novelOnly(true),
-				   greedy(true)
+				   greedy(true),
+				   bamindex(false)
 {
 }
 
@@ -26,6 +35,66 @@ teinfo::teinfo( int32_t __s, int32_t __st ) : pair<int32_t,int32_t>(__s,__st)
 {
 }
 
+teintervals::teintervals() : tes(nullptr),maxstop(nullptr),n(0)
+{
+}
+
+teintervals::teintervals( const teinfo * __tes,
+			  const int32_t * __maxstop,
+			  const size_t & __n ) : tes(__tes),maxstop(__maxstop),n(__n)
+{
+}
+
+const teinfo * teintervals::begin() const { return tes; }
+const teinfo * teintervals::end() const { return tes + n; }
+
+void teintervals::build( teinfo * __tes, int32_t * __maxstop, const size_t & __n )
+{
+  sort(__tes,__tes+__n,[](const teinfo & __l,const teinfo __r) {
+      return __l.start() < __r.start();
+    });
+  int32_t m = numeric_limits<int32_t>::min();
+  for( size_t i = 0 ; i < __n ; ++i )
+    {
+      m = max(m,__tes[i].stop());
+      __maxstop[i] = m;
+    }
+}
+
+bool teintervals::contains( const int32_t & x ) const
+{
+  //Only TEs starting at or before x can contain it, and one does if the largest stop among them is >= x
+  auto k = upper_bound(begin(),end(),x,[](const int32_t & __x, const teinfo & __t) {
+      return __x < __t.start();
+    }) - begin();
+  return k > 0 && maxstop[k-1] >= x;
+}
+
+bool teintervals::hits( const int32_t & start, const int32_t & stop ) const
+{
+  return contains(start) || contains(stop);
+}
+
+const teinfo * teintervals::first_from( const int32_t & x ) const
+{
+  //First TE starting at or after x
+  auto k = lower_bound(begin(),end(),x,[](const teinfo & __t, const int32_t & __x) {
+      return __t.start() < __x;
+    }) - begin();
+  //An earlier one that contains x comes first.  The first i with maxstop[i] >= x is such a TE if i < k.
+  auto i = lower_bound(maxstop,maxstop+k,x) - maxstop;
+  if( i < k ) return &tes[i];
+  return ( size_t(k) < n ) ? &tes[k] : nullptr;
+}
+
+const teinfo * teintervals::last_before( const int32_t & x ) const
+{
+  auto k = upper_bound(begin(),end(),x,[](const int32_t & __x, const teinfo & __t) {
+      return __x < __t.start();
+    }) - begin();
+  return ( k > 0 ) ? &tes[k-1] : nullptr;
+}
+
 cluster::cluster() : positions(make_pair(numeric_limits<int32_t>::max(),numeric_limits<int32_t>::max())),nreads(0)
   {
   }
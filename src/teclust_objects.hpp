@@ -2,8 +2,10 @@
 #define __TECLUST_OBJECTS_HPP__
 
 #include <cstdint>
+#include <cstddef>
 #include <string>
 #include <utility>
+#include <vector>
 
 struct teclust_params //Command-line parameter options
 {
@@ -17,8 +19,9 @@ struct teclust_params //Command-line parameter options
     The output of this program run on the reference genome, if available
     Directory for writing the phrap output
     An ID for the sample
+    Batch mode: file listing the samples
   */
-  std::string  reference_datafile, outfile, bamfile, readfile, umufile, ummfile, phrapdir,samplename;//,teclust_ref;
+  std::string  reference_datafile, outfile, bamfile, readfile, umufile, ummfile, phrapdir,samplename,manifest;//,teclust_ref;
   /*
     Upper limit on insert size distribution
     Maximum distance used for matching up left and right ends of putative TE calls
@@ -29,11 +32,26 @@ struct teclust_params //Command-line parameter options
     Closest distance to known TE in reference.  For PHRAP output: only write if pdist || mdist > CLOSEST
   */
   int CLOSEST;
+  /*
+    Number of threads for clustering chromosomes
+    Batch mode: max. number of samples processed at once
+  */
+  unsigned nthreads,njobs;
+  /*
+    For PHRAP output: max. number of reads written for each side of an event (0 = no limit),
+    and the random number seed for choosing them
+  */
+  unsigned maxreads,seed;
+  /*
+    Batch mode: memory (GB) for samples processed at once.  0 means half of the physical memory.
+  */
+  double maxmem;
   /*
     For PHRAP output: only try to assemble novel insertions.
     Use the greedy algo of Cridland et al.?
+    Use the BAM index to read only the parts of the BAM file near TEs?
   */
-  bool novelOnly,greedy;
+  bool novelOnly,greedy,bamindex;
   teclust_params();
 }; 
 
@@ -44,6 +62,34 @@ struct teinfo : public std::pair<std::int32_t,std::int32_t>
   teinfo( std::int32_t __s, std::int32_t __st );
 };
 
+struct teintervals
+/*
+  The reference TEs on one chromosome, sorted by start, with the
+  running maximum of their stop positions.  Because maxstop never
+  decreases, the queries below are binary searches, O(log n).
+  The arrays belong to a refTEcont (teindex.hpp), and may be part
+  of an index file mapped into memory.
+*/
+{
+  const teinfo * tes;
+  const std::int32_t * maxstop; //maxstop[i] = largest stop in tes[0..i]
+  std::size_t n;
+  teintervals();
+  teintervals( const teinfo * __tes, const std::int32_t * __maxstop, const std::size_t & __n );
+  const teinfo * begin() const;
+  const teinfo * end() const;
+  //Sort the n TEs in __tes by start, and fill in __maxstop[0..n-1]
+  static void build( teinfo * __tes, std::int32_t * __maxstop, const std::size_t & __n );
+  //Is x within (start <= x <= stop) any TE?
+  bool contains( const std::int32_t & x ) const;
+  //Is start or stop within any TE?
+  bool hits( const std::int32_t & start, const std::int32_t & stop ) const;
+  //The first TE, in order of start, that contains x or starts at or after x. nullptr if none.
+  const teinfo * first_from( const std::int32_t & x ) const;
+  //The last TE, in order of start, that starts at or before x. nullptr if none.
+  const teinfo * last_before( const std::int32_t & x ) const;
+};
+
 struct cluster
 /*
   A cluster is a group of unique reads that suggest the presence of a TE
@@ -56,4 +102,18 @@ struct cluster
 	  const int32_t & pos2,
 	  const unsigned & nr);
 };
+
+struct clusteredEvent
+/*
+  A putative TE event: a plus and/or a minus cluster, annotated with
+  respect to the reference TEs.  This is one line of teclust's output.
+  Positions are 0-offset.  For a missing cluster, first and last are -1.
+  dist is the distance to the closest TE (0 if the cluster hits one),
+  and in is 1 if the cluster hits a TE, 0 if not.  Both are -1 if the
+  cluster is missing.
+*/
+{
+  std::string chrom;
+  std::int32_t nplus,nminus,pfirst,plast,pdist,pin,mfirst,mlast,mdist,min;
+};
 #endif
@@ -1,6 +1,7 @@
 #include <teclust_parseargs.hpp>
 #include <file_common.hpp>
 #include <boost/program_options.hpp>
+#include <iostream>
 
 using namespace std;
 using namespace boost::program_options;
@@ -12,7 +13,8 @@ teclust_params teclust_parseargs(const int argc, char ** argv)
   desc.add_options()
     ("help,h", "Produce help message")
     ("bamfile,b",value<string>(&rv.bamfile),"BAM file name (optional)")
-    ("tepos,t",value<string>(&rv.reference_datafile),"File containing positions of TEs in reference genome (optional)")
+    ("bamindex","Use the index (.bai) of the BAM file to read only the regions near TEs in the reference, and the mates of reads found there, instead of the whole file.  With --phrapdir/-p, the reads for phrap are also read only from around each event.  The result is the same, as long as --isize/-i is longer than any alignment. (optional)")
+    ("tepos,t",value<string>(&rv.reference_datafile),"File containing positions of TEs in reference genome, in BED format or as an index made by pecnv teindex (optional)")
     ("sample,s",value<string>(&rv.samplename)->default_value("sample"),"Sample ID.  (optional, but very highly recommended when processing multiple samples.")
     ("outfile,o",value<string>(&rv.outfile),"Output file name for clusters (required)")
     ("umu,u",value<string>(&rv.umufile),"The um_u output file for the sample generated by pecnv process (required)")
@@ -21,32 +23,49 @@ teclust_params teclust_parseargs(const int argc, char ** argv)
     ("mdist,M",value<int32_t>(&rv.MDIST)->default_value(1000),"Max. distance for joining up left and right ends of putative TEs (required)")
     ("phrapdir,p",value<string>(&rv.phrapdir),"Name of a directory to put input files for de novo assembly of putatitve TE insertions using phrap. If the directory does not exist, it will be created. (optional)")
     ("minreads,r",value<int32_t>(&rv.MINREADS)->default_value(3),"Min. number of reads in a cluster for writing input files for phrap. (optional)")
+    ("max-reads-per-side",value<unsigned>(&rv.maxreads)->default_value(0),"For phrap output: write at most this many reads for each side of an event, chosen at random.  Default (0) is no limit. (optional)")
+    ("seed",value<unsigned>(&rv.seed)->default_value(0),"Random number seed for --max-reads-per-side. (optional)")
+    ("threads",value<unsigned>(&rv.nthreads)->default_value(1),"Number of threads for clustering.  Chromosomes are clustered in parallel, and the output is the same as for one thread. (optional)")
     ("closestTE,c",value<int>(&rv.CLOSEST)->default_value(-1),"For phrap output, only consider events >= c bp away from closest TE in the reference. (optional)")
     ("ummHitTE","When processing the um_u/um_m files, only consider reads where the M read hits a known TE.  This makes --tepos/-t a required option. (optional)")
-    ("allEvents,a","For phrap output: write files for all events. Default is only to write files for putative novel insertions");
+    ("allEvents,a","For phrap output: write files for all events. Default is only to write files for putative novel insertions")
+    ("manifest",value<string>(&rv.manifest),"Batch mode: process the samples listed in this file, one per line, as: umufile ummfile bamfile outfile [sampleID].  Use - for bamfile if there is none.  The reference TEs are read once for all samples, and the output for each sample is the same as for a separate run.  Replaces --umu/-u, --umm/-m, --bamfile/-b, and --outfile/-o.  With --phrapdir/-p, each sample's files go in a subdirectory named by its sample ID. (optional)")
+    ("jobs",value<unsigned>(&rv.njobs)->default_value(1),"Batch mode: max. number of samples to process at once. (optional)")
+    ("maxmem",value<double>(&rv.maxmem)->default_value(0.),"Batch mode: memory (GB) available to samples processed at once.  A sample is not started until its estimated memory use fits, unless no other sample is running.  Default (0) is half of the physical memory. (optional)")
     ;
 
   variables_map vm;
   store(parse_command_line(argc, argv, desc), vm);
   notify(vm);
 
+  const bool batch = vm.count("manifest");
   if( argc == 1 || 
       vm.count("help") ||
-      !vm.count("outfile") ||
-      !vm.count("umu") ||
-      !vm.count("umm") ||
+      (!batch && !vm.count("outfile")) ||
+      (!batch && !vm.count("umu")) ||
+      (!batch && !vm.count("umm")) ||
       !vm.count("isize") ||
       !vm.count("mdist") )
     {
       cerr << desc << '\n';
       exit(0);
     }
+  if( batch && (vm.count("outfile") || vm.count("umu") || vm.count("umm") || vm.count("bamfile")) )
+    {
+      cerr << "Error: --outfile/-o, --umu/-u, --umm/-m, and --bamfile/-b are given in the file passed to --manifest, not on the command line\n";
+      exit(0);
+    }
 
   if(vm.count("allEvents"))
     {
       rv.novelOnly=false;
     }
 
+  if(vm.count("bamindex"))
+    {
+      rv.bamindex = true;
+    }
+
   if(vm.count("ummHitTE"))
     {
       rv.greedy = false;
@@ -74,6 +93,8 @@ teclust_params teclust_parseargs(const int argc, char ** argv)
       cerr << "Error: value passed to --minreads/-r must be > 0\n";
       exit(0);
     }
+  if( rv.nthreads == 0 ) rv.nthreads = 1;
+  if( rv.njobs == 0 ) rv.njobs = 1;
 
   //Check that specified input files exist
   if( vm.count("bamfile") )
@@ -94,6 +115,17 @@ teclust_params teclust_parseargs(const int argc, char ** argv)
 	       << " does not exist\n";
 	}
     }
+  if( batch )
+    {
+      if (!file_exists(rv.manifest.c_str()))
+	{
+	  cerr << "Error: "
+	       << rv.manifest
+	       << " does not exist\n";
+	  exit(0);
+	}
+      return rv;
+    }
   if (!file_exists(rv.umufile.c_str()))
     {
       cerr << "Error: "
@@ -1,20 +1,21 @@
 #include <teclust_phrapify.hpp>
 #include <common.hpp>
+#include <bamregion.hpp>
 
 #include <sstream>
 #include <iostream>
 #include <vector>
-#include <unordered_set>
+#include <unordered_map>
+#include <limits>
+#include <random>
 #include <utility>
 #include <functional>
 #include <algorithm>
 #include <fstream>
-#include <iterator>
-#include <cassert>
 #include <cstring>
+#include <cassert>
 #include <Sequence/bamreader.hpp>
 #include <Sequence/samfunctions.hpp>
-#include <Sequence/Fasta.hpp>
 
 //For file creation, etc.
 #include <sys/stat.h>
@@ -23,95 +24,12 @@
 using namespace std;
 using namespace Sequence;
 
-struct clusteredEvent
-{
-  string chrom;
-  int32_t nplus,nminus,pfirst,plast,pdist,pin,mfirst,mlast,mdist,min;
-  std::istream & read(istream &);     //Thru version 0.1.4
-  std::istream & read_bed(istream &); //For BED format output, 0.1.5+
-};
-
-istream & clusteredEvent::read(istream & in)
-{
-  in >> chrom >> nplus >> nminus >> pfirst >> plast
-     >> pdist >> pin >> mfirst >> mlast 
-     >> mdist >> min;
-  return in;
-}
-
-istream & clusteredEvent::read_bed(istream & in)
-{
-  string chr2,name,score,strand1,strand2,xtra;
-  in >> chrom >> pfirst >> plast 
-     >> chr2  >> mfirst >> mlast 
-     >> name >> score >> strand1 >> strand2 >> xtra;
-  //Subtract 1 from plast and mlast to change to 0-offset, if they are > -1
-  if( plast != -1 ) --pfirst;
-  if( mlast != -1 ) --mlast;
-
-  //if chrom is unknown (.), then chr2 must not be, so we can assign chr2 to chrom
-  if(chrom == ".") chrom = chr2;
-  assert( chrom != "." );
-
-  //parse the extra stuff, which is 6 fields : nplus, nminus, pdist, pin, mdist, min
-  char * tok = strtok( const_cast<char*>(xtra.c_str()), ":" );
-  short field = 0;
-  while( tok != NULL )
-    {
-      if(field==0)
-	{
-	  nplus = stoi(tok);
-	}
-      else if(field==1)
-	{
-	  nminus = stoi(tok);
-	}
-      else if(field==2)
-	{
-	  pdist = stoi(tok);
-	}
-      else if(field==3)
-	{
-	  pin = stoi(tok);
-	}
-      else if(field==4)
-	{
-	  mdist = stoi(tok);
-	}
-      else if(field==5)
-	{
-	  min = stoi(tok);
-	}
-      ++field;
-      tok = strtok(NULL,":");
-    }
-  if(field != 6)
-    {
-      cerr << "Error parsing xtra field data on line "
-	   << __LINE__ << " of " << __FILE__ << '\n';
-      exit(10);
-    }
-  return in;
-}
-
-istream & operator>>(istream & in, clusteredEvent & ce)
-{
-  //return ce.read(in);
-  return ce.read_bed(in);
-}
-
-vector<clusteredEvent> parseClusters(const string & clusters,const teclust_params & pars)
+vector<clusteredEvent> filterClusters(const vector<clusteredEvent> & events,const teclust_params & pars)
 //Replaces functionality of filter_edit, but w/more flexibility
 {
   vector<clusteredEvent> cEs;
-  istringstream in(clusters);
-  string temp;
-  //Assuming BEDPE input now, so no more header
-  //getline(in,temp);//get rid of header
-  while(!in.eof()) //read records
+  for( const auto & e : events )
     {
-      clusteredEvent e;
-      in >> e >> ws;
       if(e.nplus >= pars.MINREADS && e.nminus >= pars.MINREADS) //filter on read number
 	{
 	  if( e.pdist >= pars.CLOSEST && e.mdist >= pars.CLOSEST && 
@@ -124,20 +42,12 @@ vector<clusteredEvent> parseClusters(const string & clusters,const teclust_param
   return cEs;
 }
 
-using LeftRights = pair<unordered_set<string>,
-			unordered_set<string> >;
-using ReadCollection = unordered_set<string>;
-using PhrapInput = vector< pair<pair< vector<Fasta>, vector<Fasta> >,
-				pair< vector<Fasta>, vector<Fasta> > > >;
-
-auto Cfinder = [](const clusteredEvent & __cE,
-		  const bool & strand,
-		  const int32_t & pos,
-		  const int32_t & INSERTSIZE,
-		  const string & chrom,
-		  int * side)
+//Which side of __cE a read at pos on strand is collected for: 0 = left, 1 = right, -1 = neither
+int event_side(const clusteredEvent & __cE,
+	       const bool & strand,
+	       const int32_t & pos,
+	       const int32_t & INSERTSIZE)
 {
-  if(__cE.chrom != chrom) return false;
   if( !strand ) //if read is on + strand
     {
       //If read is 5' of this cluster's end
@@ -146,11 +56,10 @@ auto Cfinder = [](const clusteredEvent & __cE,
 	  ( abs(pos-__cE.pfirst) <= INSERTSIZE ||
 	    abs(pos-__cE.plast) <= INSERTSIZE ) )
 	{
-	  *side = 0; //LEFT
-	  return true;
+	  return 0; //LEFT
 	}
     }
-  else if (strand) //read is on - strand
+  else //read is on - strand
     {
       //If read is 3' of this cluster's start
       if( pos > __cE.mfirst &&
@@ -158,54 +67,259 @@ auto Cfinder = [](const clusteredEvent & __cE,
 	  ( abs(pos-__cE.mfirst) <= INSERTSIZE ||
 	    abs(pos-__cE.mlast) <= INSERTSIZE ) )
 	{
-	  *side = 1; //RIGHT
-	  return true;
+	  return 1; //RIGHT
 	}
     }
-  return false;
-};
+  return -1;
+}
 
-ReadCollection
-getRnames( const teclust_params & pars,
-	   const vector<clusteredEvent> & cEs )
+struct eventwindows
+/*
+  The windows on one chromosome in which reads may be collected for one
+  side of an event: the span of that side's cluster, padded by INSERTSIZE.
+  event_side() is only >= 0 for reads in a window.  As for teintervals,
+  the windows are sorted by start, with the running maximum of their
+  ends, so those containing a position are found by binary search.
+*/
 {
+  struct window
+  {
+    int32_t beg,end; //[beg,end]
+    size_t event;
+  };
+  vector<window> w;
+  vector<int32_t> maxend;
+  void add( const int32_t & first, const int32_t & last,
+	    const int32_t & INSERTSIZE, const size_t & event )
+  {
+    w.push_back( window{min(first,last)-INSERTSIZE,max(first,last)+INSERTSIZE,event} );
+  }
+  void build()
+  {
+    sort(w.begin(),w.end(),[](const window & __l, const window & __r) { return __l.beg < __r.beg; });
+    maxend.resize(w.size());
+    int32_t m = numeric_limits<int32_t>::min();
+    for( size_t i = 0 ; i < w.size() ; ++i )
+      {
+	m = max(m,w[i].end);
+	maxend[i] = m;
+      }
+  }
+  //Calls f(event) for each window containing pos
+  template<typename F>
+  void visit( const int32_t & pos, const F & f ) const
+  {
+    auto k = upper_bound(w.cbegin(),w.cend(),pos,[](const int32_t & __x, const window & __w) {
+	return __x < __w.beg;
+      }) - w.cbegin();
+    //No window before the first whose maxend is >= pos contains pos
+    for( auto i = lower_bound(maxend.cbegin(),maxend.cbegin()+k,pos) - maxend.cbegin() ; i < k ; ++i )
+      {
+	if( w[i].end >= pos ) f(w[i].event);
+      }
+  }
+};
 
-  bamreader reader(pars.bamfile.c_str());
+//By BAM reference id: the windows for the left and right sides of the events
+using phrapwindows = vector<pair<eventwindows,eventwindows> >;
 
-  if(! reader )
+phrapwindows make_windows( const bamreader & reader,
+			   const vector<clusteredEvent> & cEs,
+			   const int32_t & INSERTSIZE )
+{
+  unordered_map<string,int32_t> refids;
+  for( auto r = reader.ref_cbegin() ; r != reader.ref_cend() ; ++r )
     {
-      cerr << "Error: could not open " << pars.bamfile
-	   << " for reading. Line " << __LINE__
-	   << " of " << __FILE__ << '\n';
-      exit(1);
+      refids.emplace(r->first,int32_t(r - reader.ref_cbegin()));
     }
+  phrapwindows rv(refids.size());
+  for( size_t i = 0 ; i < cEs.size() ; ++i )
+    {
+      auto r = refids.find(cEs[i].chrom);
+      if( r == refids.end() ) continue;
+      if( cEs[i].pfirst != -1 && cEs[i].plast != -1 ) rv[r->second].first.add(cEs[i].pfirst,cEs[i].plast,INSERTSIZE,i);
+      if( cEs[i].mfirst != -1 && cEs[i].mlast != -1 ) rv[r->second].second.add(cEs[i].mfirst,cEs[i].mlast,INSERTSIZE,i);
+    }
+  for( auto & r : rv )
+    {
+      r.first.build();
+      r.second.build();
+    }
+  return rv;
+}
 
-  ReadCollection rv;//( cEs.size() );
-  while(!reader.eof() && !reader.error())
+/*
+  The reads collected for phrap.  Each is stored once, however many
+  event sides it is collected for: its name, sequence, and qualities
+  (one byte per base, as in the BAM file) are appended to data, and the
+  sides refer to it by its index in reads.  Reads are added in file order.
+  Reads that no side refers to any more, because a sample replaced them,
+  are removed from data once they take up most of it.
+*/
+struct readarena
+{
+  struct entry
+  {
+    uint64_t offset;
+    uint64_t order; //position in the order reads were added
+    uint32_t namelen,seqlen,quallen,nrefs;
+  };
+  string data;
+  vector<entry> reads;
+  vector<size_t> unused; //indexes of reads with nrefs == 0, to be reused
+  uint64_t garbage; //bytes of data used by reads with nrefs == 0
+  uint64_t nadded;
+  readarena() : data(),reads(),unused(),garbage(0),nadded(0)
+  {
+  }
+  //Add a read, with no references to it yet.  Returns its index.
+  size_t add( const string & name, const bamrecord & b )
+  {
+    const uint64_t offset = data.size();
+    data += name;
+    data += b.seq();
+    const uint64_t qualoffset = data.size();
+    data.append(b.qual_cbegin(),b.qual_cend());
+    const entry e{offset,nadded++,uint32_t(name.size()),uint32_t(qualoffset-offset-name.size()),uint32_t(data.size()-qualoffset),0};
+    if( unused.empty() )
+      {
+	reads.push_back(e);
+	return reads.size()-1;
+      }
+    const size_t i = unused.back();
+    unused.pop_back();
+    reads[i] = e;
+    return i;
+  }
+  uint64_t size( const entry & e ) const
+  {
+    return uint64_t(e.namelen) + e.seqlen + e.quallen;
+  }
+  void release( const size_t & i )
+  {
+    if( --reads[i].nrefs ) return;
+    garbage += size(reads[i]);
+    unused.push_back(i);
+    if( garbage > (1u<<20) && garbage > data.size()/2 ) compact();
+  }
+  void compact()
+  {
+    string live;
+    live.reserve(data.size()-garbage);
+    for( auto & e : reads )
+      {
+	if( !e.nrefs ) continue;
+	const uint64_t offset = live.size();
+	live.append(data,e.offset,size(e));
+	e.offset = offset;
+      }
+    data.swap(live);
+    garbage = 0;
+  }
+  const char * name( const size_t & i ) const { return data.data() + reads[i].offset; }
+  const char * seq( const size_t & i ) const { return name(i) + reads[i].namelen; }
+  const char * qual( const size_t & i ) const { return seq(i) + reads[i].seqlen; }
+};
+
+/*
+  The reads collected for each side of each event (side 2*event + 0/1),
+  as indexes into arena.  A read is wanted for an event side if
+  event_side() says so.  An unmapped read must also have a mapped mate
+  that is wanted for some event (see collect_read).
+
+  If maxreads > 0, each side keeps a uniform random sample of at most
+  maxreads of the reads offered to it (reservoir sampling), and the arena
+  reuses the space of reads that no side keeps, so memory does not grow
+  with depth.  The random numbers are drawn in file order
+  from one generator, so the sample depends only on the seed.
+*/
+struct phrapreads
+{
+  static const size_t none = numeric_limits<size_t>::max();
+  readarena arena;
+  vector<vector<size_t> > sides;
+  vector<uint64_t> offered; //per side, the number of reads offered
+  unsigned maxreads;
+  mt19937_64 rng;
+  phrapreads( const size_t & nevents, const unsigned & __maxreads, const unsigned & seed ) : arena(),
+											      sides(2*nevents),
+											      offered(2*nevents,0),
+											      maxreads(__maxreads),
+											      rng(seed)
+  {
+  }
+  //Where a read offered to side s is to be stored, or nullptr if it is not kept.  The slot may hold a read to be replaced.
+  size_t * slot( const size_t & s )
+  {
+    const uint64_t i = offered[s]++;
+    if( maxreads == 0 || i < maxreads )
+      {
+	sides[s].push_back(none);
+	return &sides[s].back();
+      }
+    //Keep the i-th read offered with probability maxreads/(i+1), in place of a random one
+    const uint64_t j = uniform_int_distribution<uint64_t>(0,i)(rng);
+    return ( j < maxreads ) ? &sides[s][j] : nullptr;
+  }
+};
+
+const size_t phrapreads::none;
+
+void collect_read( const bamrecord & b,
+		   const phrapwindows & windows,
+		   const vector<clusteredEvent> & cEs,
+		   const int32_t & INSERTSIZE,
+		   phrapreads * pr )
+{
+  if( b.refid() < 0 || unsigned(b.refid()) >= windows.size() ) return;
+  samflag bf(b.flag());
+  if( bf.query_unmapped )
     {
-      bamrecord b = reader.next_record();
-      if(b.empty()) break;
-      samflag bf(b.flag());
-      if(!bf.query_unmapped)
+      /*
+	An unmapped read is placed at its mate's position.  Its mate is
+	collected if it is mapped and wanted for some event on its own
+	strand.  Deciding this here, rather than after the reads are read,
+	means no reservoir slot goes to a read that would be dropped.
+      */
+      const int32_t mrefid = b.next_refid(),mpos = b.next_pos();
+      if( bf.mate_unmapped || mrefid < 0 || unsigned(mrefid) >= windows.size() ) return;
+      bool matewanted = false;
+      (bf.mstrand ? windows[mrefid].second : windows[mrefid].first).visit(mpos,[&](const size_t & event) {
+	  if( event_side(cEs[event],bf.mstrand,mpos,INSERTSIZE) >= 0 ) matewanted = true;
+	});
+      if( !matewanted ) return;
+    }
+  const eventwindows & w = bf.qstrand ? windows[b.refid()].second : windows[b.refid()].first;
+  const int32_t pos = b.pos();
+  bool wanted = false;
+  size_t stored = phrapreads::none;
+  string n;
+  w.visit(pos,[&](const size_t & event) {
+      const int side = event_side(cEs[event],bf.qstrand,pos,INSERTSIZE);
+      if( side < 0 ) return;
+      if( !wanted )
 	{
-	  int side = -1;//-1 = not known, 0 = left, 1 = right
-	  string chrom = (reader.ref_cbegin() + b.refid())->first; //Get the string representing this read's chromosome
-	  //Is the alignment start position of this read w/in ISIZE
-	  //of a (filtered) cluster?
-	  auto cluster  = find_if(cEs.cbegin(),cEs.cend(),
-				  bind(Cfinder,placeholders::_1,bf.qstrand,b.pos(),pars.INSERTSIZE,chrom,&side));
-	  if( cluster != cEs.cend() )
-	    {
-	      rv.insert(editRname(b.read_name()));
-	    }
+	  wanted = true;
+	  n = editRname(b.read_name());
 	}
-    }
-  
-  return rv;
+      size_t * r = pr->slot(2*event + size_t(side));
+      if( r == nullptr ) return;
+      //The read is only stored once some side keeps it
+      if( stored == phrapreads::none ) stored = pr->arena.add(n,b);
+      ++pr->arena.reads[stored].nrefs;
+      if( *r != phrapreads::none ) pr->arena.release(*r);
+      *r = stored;
+    });
 }
 
-PhrapInput seqQual( const teclust_params & pars, const vector<clusteredEvent> & cEs,
-		    const ReadCollection & r )
+/*
+  Get the sequences and quality scores of the reads for both sides of each event, in one pass over the BAM file.
+  This replaces two passes, first for the names of the reads near each event, and then for those reads.
+  With pars.bamindex, only the windows around the events are read, using the index.  Every read that
+  may be collected, including an unmapped read placed at its mate's position, is in a window, and merged
+  windows are read in order, so the reads collected are the same.
+*/
+phrapreads seqQual( const teclust_params & pars, const vector<clusteredEvent> & cEs )
 {
   bamreader reader(pars.bamfile.c_str());
 
@@ -217,46 +331,48 @@ PhrapInput seqQual( const teclust_params & pars, const vector<clusteredEvent> &
       exit(1);
     }
 
-  PhrapInput rv(cEs.size());
-  while(!reader.eof() && !reader.error())
+  const phrapwindows windows = make_windows(reader,cEs,pars.INSERTSIZE);
+  phrapreads pr(cEs.size(),pars.maxreads,pars.seed);
+  if( pars.bamindex )
     {
-      bamrecord b = reader.next_record();
-      if(b.empty()) break;
-      string n = editRname(b.read_name());
-      if ( r.find(n) != r.end() )
+      bam_index index(pars.bamfile.c_str());
+      if( !index )
+	{
+	  cerr << "Error: --bamindex requires an index (.bai file) for "
+	       << pars.bamfile << '\n';
+	  exit(1);
+	}
+      for( int32_t refid = 0 ; unsigned(refid) < windows.size() ; ++refid )
 	{
-	  samflag bf(b.flag()); 
-	  int side = -1;//-1 = not known, 0 = left, 1 = right
-	  string chrom = (reader.ref_cbegin() + b.refid())->first; //Get the string representing this read's chromosome
-	  //Is the alignment start position of this read w/in ISIZE
-	  //of a (filtered) cluster?
-	  auto cluster  = find_if(cEs.cbegin(),cEs.cend(),
-				  bind(Cfinder,placeholders::_1,bf.qstrand,b.pos(),pars.INSERTSIZE,chrom,&side));
-	  while( cluster != cEs.cend() )
+	  //Windows of both sides, as [beg,end)
+	  bam_regions regions;
+	  for( const eventwindows * w : { &windows[refid].first, &windows[refid].second } )
 	    {
-	      auto rvitr = rv.begin() + (cluster-cEs.cbegin());
-	       	  string qstring;
-		  for_each(b.qual_cbegin(),b.qual_cend(),
-			   [&](const int8_t & __i) {
-			     qstring += to_string(int(__i+33)) + ' ';
-			   });
-	      if(side==0)
-		{
-		  rvitr->first.first.push_back(Fasta(n,b.seq()));
-		  rvitr->first.second.push_back(Fasta(n,qstring));
-		}
-	      else if (side == 1)
+	      for( const auto & i : w->w )
 		{
-		  rvitr->second.first.push_back(Fasta(n,b.seq()));
-		  rvitr->second.second.push_back(Fasta(n,qstring));
+		  if( i.end >= 0 ) regions.emplace_back(max(0,i.beg),i.end+1);
 		}
-	      side = -1;
-	      cluster = find_if(cluster+1,cEs.cend(),
-				bind(Cfinder,placeholders::_1,bf.qstrand,b.pos(),pars.INSERTSIZE,chrom,&side));
+	    }
+	  merge_regions(regions);
+	  for( const auto & r : regions )
+	    {
+	      fetch_region(reader,index,refid,r.first,r.second,[&](bamrecord & b) {
+		  collect_read(b,windows,cEs,pars.INSERTSIZE,&pr);
+		  return true;
+		});
 	    }
 	}
     }
-  return rv;
+  else
+    {
+      while(!reader.eof() && !reader.error())
+	{
+	  bamrecord b = reader.next_record();
+	  if(b.empty()) break;
+	  collect_read(b,windows,cEs,pars.INSERTSIZE,&pr);
+	}
+    }
+  return pr;
 }
 
 string baseName(const string & basedir,
@@ -270,56 +386,160 @@ string baseName(const string & basedir,
   return n;
 }
 
-void write2file(const string & filename,
-		const vector<Fasta> & vf )
+/*
+  The text of each quality byte in a phrap .qual file: the score + 33,
+  then a space.  No entry is longer than 4 characters, so each is copied
+  with one fixed-size memcpy.
+*/
+struct qualtable
+{
+  char text[256][4];
+  unsigned char len[256];
+  qualtable()
+  {
+    for( unsigned i = 0 ; i < 256 ; ++i )
+      {
+	const string t = to_string(int(int8_t(i))+33) + ' ';
+	memset(text[i],' ',4);
+	memcpy(text[i],t.data(),t.size());
+	len[i] = (unsigned char)(t.size());
+      }
+  }
+  //Append the text for the n qualities in q to buffer
+  void format( const char * q, const size_t & n, string * buffer ) const
+  {
+    const size_t start = buffer->size();
+    buffer->resize(start + 4*n);
+    char * p = &(*buffer)[start];
+    for( size_t i = 0 ; i < n ; ++i )
+      {
+	const unsigned char c = (unsigned char)(q[i]);
+	memcpy(p,text[c],4);
+	p += len[c];
+      }
+    buffer->resize(size_t(p - buffer->data()));
+  }
+};
+
+class fastawriter
+/*
+  Writes a FASTA file through a buffer that is reused from file to file,
+  so that writing many files does not allocate per read or per base.
+*/
+{
+  string buffer;
+  ofstream out;
+  string filename;
+  void flush()
+  {
+    if( !out.write(buffer.data(),streamsize(buffer.size())) )
+      {
+	cerr << "Error: could not write to "
+	     << filename
+	     << " at line " << __LINE__
+	     << " of " << __FILE__ << '\n';
+	exit(1);
+      }
+    buffer.clear();
+  }
+public:
+  void open( const string & fn )
+  {
+    filename = fn;
+    out.open(filename.c_str());
+    if(!out) 
+      {
+	cerr << "Error: could not open "
+	     << filename 
+	     << " for writing at line " << __LINE__ 
+	     << " of " << __FILE__ << '\n';
+	exit(1);
+      }
+    buffer.clear();
+  }
+  //Start a record, and return the buffer to append its text to.
+  string & record( const char * name, const size_t & namelen )
+  {
+    if( buffer.size() > (1u<<20) ) flush();
+    buffer += '>';
+    buffer.append(name,namelen);
+    buffer += '\n';
+    return buffer;
+  }
+  void close()
+  {
+    flush();
+    out.close();
+    out.clear();
+  }
+};
+
+/*
+  Write the .fasta and .fasta.qual files for one side of an event.
+  The reads are indexes into arena, in file order.
+*/
+void write_side( const string & seqfilename,
+		 const readarena & arena,
+		 const vector<size_t> & reads,
+		 const qualtable & qt,
+		 fastawriter * writer )
 {
-  ofstream out(filename.c_str());
-  if(!out) 
+  writer->open(seqfilename);
+  for( const auto & r : reads )
     {
-      cerr << "Error: could not open "
-	   << filename 
-	   << " for writing at line " << __LINE__ 
-	   << " of " << __FILE__ << '\n';
-      exit(1);
+      const auto & e = arena.reads[r];
+      writer->record(arena.name(r),e.namelen).append(arena.seq(r),e.seqlen) += '\n';
     }
-  copy(vf.cbegin(),vf.cend(),ostream_iterator<const Fasta>(out,"\n"));
+  writer->close();
+  writer->open(seqfilename + ".qual");
+  for( const auto & r : reads )
+    {
+      const auto & e = arena.reads[r];
+      string & buffer = writer->record(arena.name(r),e.namelen);
+      qt.format(arena.qual(r),e.quallen,&buffer);
+      buffer += '\n';
+    }
+  writer->close();
 }
 
 void output( const teclust_params & pars,
 	     const vector<clusteredEvent> & cEs,
-	     const PhrapInput & pI )
+	     phrapreads & pr )
 {
-  auto __pi = pI.cbegin();
-  for_each( cEs.cbegin(),
-	    cEs.cend(),
-	    [&](const clusteredEvent & __c) {
-	      if( ! __pi->first.first.empty() ) //Then we have some "LEFT" reads stored
-		{
-		  assert( __c.pfirst != -1 && __c.plast != -1 );
-		  assert( __pi->first.first.size() == __pi->first.second.size() );
-		  string seqfilename = baseName(pars.phrapdir,__c.chrom,__c.pfirst,__c.plast,0);
-		  string qualfilename = seqfilename + ".qual";
-		  write2file(seqfilename,__pi->first.first);
-		  write2file(qualfilename,__pi->first.second);
-		}	      
-	      if( ! __pi->second.first.empty() ) //Then we have some "LEFT" reads stored
-		{
-		  assert( __c.mfirst != -1 && __c.mlast != -1 );
-		  assert( __pi->second.first.size() == __pi->second.second.size() );
-		  string seqfilename = baseName(pars.phrapdir,__c.chrom,__c.mfirst,__c.mlast,1);
-		  string qualfilename = seqfilename + ".qual";
-		  write2file(seqfilename,__pi->second.first);
-		  write2file(qualfilename,__pi->second.second);
-		}
-	      ++__pi;
-	    });
+  const qualtable qt;
+  fastawriter writer;
+  for( size_t s = 0 ; s < pr.sides.size() ; ++s )
+    {
+      //Reads are added to the arena in file order, but a reservoir sample is not kept in that order, so it is sorted here
+      vector<size_t> & reads = pr.sides[s];
+      if( pr.maxreads ) sort(reads.begin(),reads.end(),[&pr](const size_t & a, const size_t & b) {
+	  return pr.arena.reads[a].order < pr.arena.reads[b].order;
+	});
+      if( reads.empty() ) continue;
+      const clusteredEvent & __c = cEs[s/2];
+      if( s % 2 == 0 ) //LEFT
+	{
+	  assert( __c.pfirst != -1 && __c.plast != -1 );
+	  write_side(baseName(pars.phrapdir,__c.chrom,__c.pfirst,__c.plast,0),pr.arena,reads,qt,&writer);
+	}
+      else //RIGHT
+	{
+	  assert( __c.mfirst != -1 && __c.mlast != -1 );
+	  write_side(baseName(pars.phrapdir,__c.chrom,__c.mfirst,__c.mlast,1),pr.arena,reads,qt,&writer);
+	}
+      vector<size_t>().swap(reads);
+    }
+}
+
+bool phrapify_wanted( const teclust_params & pars )
+{
+  return !pars.phrapdir.empty() && !pars.bamfile.empty();
 }
 
 void phrapify( const teclust_params & pars,
-	       const string & clusters )
+	       const vector<clusteredEvent> & events )
 {
-  if(pars.phrapdir.empty()) return;
-  if(pars.bamfile.empty()) return;
+  if(!phrapify_wanted(pars)) return;
 
   //Try to create the output directory
   int status = mkdir( pars.phrapdir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH );
@@ -332,13 +552,10 @@ void phrapify( const teclust_params & pars,
       exit(1);
     }
   //This is the new "filter_edit"
-  vector<clusteredEvent> cEs = parseClusters(clusters,pars);
+  vector<clusteredEvent> cEs = filterClusters(events,pars);
  
-  //Collect the names of all read pairs on the proper strand for each event
-  auto LR = getRnames(pars,cEs);
-
-  //Get the sequences and quality scores for all sequences for both sides
-  auto sq = seqQual(pars,cEs,LR);
+  //Get the sequences and quality scores of the reads for both sides of each event
+  auto sq = seqQual(pars,cEs);
 
   //Output
   output(pars,cEs,sq);
@@ -1,10 +1,14 @@
 #ifndef __PHRAPIFY_HPP__
 #define __PHRAPIFY_HPP__
 
-#include <string>
+#include <vector>
 #include <teclust_objects.hpp>
 
+//Are phrap input files wanted, i.e. were a BAM file and an output directory given?
+bool phrapify_wanted( const teclust_params & pars );
+
+//Write phrap input files for the events that pass the filters in pars
 void phrapify( const teclust_params & pars,
-	       const std::string & clusters );
+	       const std::vector<clusteredEvent> & events );
 
 #endif
@@ -6,6 +6,7 @@
 #include <unordered_map>
 #include <algorithm>
 #include <common.hpp>
+#include <bamregion.hpp>
 #include <sys/stat.h>
 
 using namespace std;
@@ -13,15 +14,56 @@ using namespace Sequence;
 
 using puu = pair<int32_t,int8_t>;
 
-using refIDlookup = unordered_map<int32_t,string>;
+//Per BAM refid: the chromdict id, and the reference TEs on that chromosome (nullptr if none)
+struct refIDlookup
+{
+  vector<int32_t> ids;
+  vector<const teintervals *> tes;
+};
+
+//How a read relates to the reference TEs
+struct readTEs
+{
+  int32_t id,start; //chromdict id, and start of the alignment
+  int8_t strand;
+  size_t namelen;   //length of the read name, without any #...
+  uint64_t key;     //name_fingerprint of the read name
+  /*
+    hitsTE: the read's start or stop is within a TE.
+    TEpair: hitsTE, and its mate does not hit a TE, as far as we can tell from its start.
+    candidate: the read is on a chromosome with TEs, but does not hit one.
+    It is kept if a read of its pair is a TEpair.
+  */
+  bool hitsTE,TEpair,candidate;
+};
 
 //DEFINITION OF FUNCTIONS
-refIDlookup make_lookup(const bamreader & reader);
+refIDlookup make_lookup(const bamreader & reader,
+			const refTEcont & refTEs,
+			chromdict * chroms);
+
+/*
+  Classify b, and set name to its read name.  Returns false if b is not used at all,
+  because a read of the pair is unmapped, b is a secondary or supplementary
+  alignment, or the pair is already in readPairs.
+*/
+bool classify(const bamrecord & b,
+	      const refIDlookup & lookup,
+	      const nameset & readPairs,
+	      string * name,
+	      readTEs * r);
+
+void scan_bamfile_indexed(const teclust_params & p,
+			  const bamreader & reader,
+			  const refIDlookup & lookup,
+			  const nameset & readPairs,
+			  vector<vector< puu > > * data);
 
 void scan_bamfile(const teclust_params & p,
 		  const refTEcont & refTEs,
-		  unordered_set<string> * readPairs,
-		  map<string,vector< puu > > * data)
+		  const nameset * readPairs,
+		  vector<vector< puu > > * data,
+		  chromdict * chroms)
 {
   if( refTEs.empty() || p.bamfile.empty() ) return; 
   struct stat buf;
@@ -40,138 +82,229 @@ void scan_bamfile(const teclust_params & p,
       exit(0);
     }
 
-  auto lookup = make_lookup(reader);
+  auto lookup = make_lookup(reader,refTEs,chroms);
 
-  auto firstREC = reader.tell();
-  unordered_set<string> RPlocal;
+  if( p.bamindex )
+    {
+      scan_bamfile_indexed(p,reader,lookup,*readPairs,data);
+      return;
+    }
+
+  /*
+    One pass over the file.  A pair is wanted if one read hits a TE
+    (and its mate's start does not), and then each of its reads that
+    is on a chromosome with TEs but does not hit one is kept.
+    Reads of a pair may come in either order, so until both have been
+    seen the pair is held in a table keyed by the name's 64-bit fingerprint,
+    along with a read that may have to be kept if its mate turns out
+    to hit a TE.  Once both reads are seen, the entry is dropped.
+    classify() only passes primary alignments, so a pair has exactly two.
+    Entries hold the name, so pairs whose fingerprints collide are kept apart.
+  */
+  struct pairstate
+  {
+    string name;        //without any #...
+    int32_t id,start;   //the read that may be kept
+    int8_t strand;
+    bool pending,       //is there such a read?
+      hitsTE;           //has a read of this pair been found to hit a TE?
+    uint8_t nseen;
+  };
+  unordered_multimap<uint64_t,pairstate> open;
+  nameset RPlocal; //Pairs with a read hitting a TE, once both reads have been seen
+  auto keep = [data](const int32_t & id, const int32_t & start, const int8_t & strand) {
+    if( unsigned(id) >= data->size() ) data->resize(id+1);
+    (*data)[id].emplace_back(make_pair(start,strand));
+  };
   while(! reader.eof() && !reader.error() )
     {
       bamrecord b = reader.next_record();
       if(b.empty()) break;
-      samflag f(b.flag());
-      if( !f.query_unmapped && !f.mate_unmapped )
-	//then both reads are mapped 
+      string n;
+      readTEs r;
+      if( classify(b,lookup,*readPairs,&n,&r) )
 	{
-	  auto n = editRname(b.read_name());
-	  if( readPairs->find(n) == readPairs->end())
+	  const bool TEpair = r.TEpair, candidate = r.candidate;
+	  const uint64_t key = r.key;
+	  if( RPlocal.contains(n.data(),r.namelen) )
+	    {
+	      if( candidate ) keep(r.id,r.start,r.strand);
+	      continue;
+	    }
+	  auto range = open.equal_range(key);
+	  auto i = find_if(range.first,range.second,[&](const pair<const uint64_t,pairstate> & __e) {
+	      return __e.second.name.size() == r.namelen && n.compare(0,r.namelen,__e.second.name) == 0;
+	    });
+	  if( i == range.second )
+	    {
+	      //A read that neither hits a TE nor may be kept does not need an entry
+	      if( !TEpair && !candidate ) continue;
+	      i = open.emplace(key,pairstate{n.substr(0,r.namelen),0,0,0,false,false,0});
+	    }
+	  pairstate & ps = i->second;
+	  ++ps.nseen;
+	  if( TEpair && !ps.hitsTE )
+	    {
+	      ps.hitsTE = true;
+	      if( ps.pending ) keep(ps.id,ps.start,ps.strand);
+	      ps.pending = false;
+	    }
+	  if( candidate )
 	    {
-	      auto itr = lookup.find(b.refid());
-	      
-	      if(itr == lookup.end())
+	      if( ps.hitsTE ) keep(r.id,r.start,r.strand);
+	      else if( !ps.pending )
 		{
-		  cerr << "Error: reference ID " << b.refid()
-		       << " not found in BAM file header. Line "
-		       << __LINE__ 
-		       << " of " << __FILE__ << '\n';
-		  exit(1);
+		  ps.id = r.id;
+		  ps.start = r.start;
+		  ps.strand = r.strand;
+		  ps.pending = true;
 		}
-	      
-	      //Now, does the read overlap a known TE?
-	      int32_t start = b.pos(),stop=b.pos() + alignment_length(b) - 1;
-	      auto CHROM = refTEs.find(itr->second);
-	      if( CHROM != refTEs.end() )
+	    }
+	  if( ps.nseen == 2 )
+	    {
+	      if( ps.hitsTE ) RPlocal.insert(n.data(),r.namelen);
+	      open.erase(i);
+	    }
+	}
+    }
+  //Pairs still open at the end either had a read hitting a TE, and are done, or are not wanted.
+}
+
+bool classify(const bamrecord & b,
+	      const refIDlookup & lookup,
+	      const nameset & readPairs,
+	      string * name,
+	      readTEs * r)
+{
+  samflag f(b.flag());
+  if( f.query_unmapped || f.mate_unmapped ) return false;
+  //Only the primary alignment of each read, so that a pair has two records (0x800 = supplementary)
+  if( !f.is_primary || (f.flag & 0x800) ) return false;
+  //then both reads are mapped 
+  *name = b.read_name();
+  r->namelen = rname_length(*name);
+  if( readPairs.contains(name->data(),r->namelen) ) return false;
+  r->key = name_fingerprint(name->data(),r->namelen);
+  if( b.refid() < 0 || unsigned(b.refid()) >= lookup.ids.size() )
+    {
+      cerr << "Error: reference ID " << b.refid()
+	   << " not found in BAM file header. Line "
+	   << __LINE__ 
+	   << " of " << __FILE__ << '\n';
+      exit(1);
+    }
+  //Now, does the read overlap a known TE?
+  int32_t start = b.pos(),stop=b.pos() + alignment_length(b) - 1;
+  const teintervals * CHROM = lookup.tes[b.refid()];
+  r->id = lookup.ids[b.refid()];
+  r->start = start;
+  r->strand = f.qstrand;
+  r->hitsTE = CHROM != nullptr && CHROM->hits(start,stop);
+  /*
+    If mate is mapped to same chromo & hits a TE,
+    the pair is not wanted.
+    We don't have access to it's mates start and stop,
+    but we can check the start.
+  */
+  r->TEpair = r->hitsTE && ( b.refid() != b.next_refid() || !CHROM->contains(b.next_pos()) );
+  /*
+    Note: Julie's script does not check that these reads map uniquely.
+  */
+  r->candidate = CHROM != nullptr && !r->hitsTE;
+  return true;
+}
+
+/*
+  For sorted, indexed BAM files: read only the regions around
+  the reference TEs, and then the positions of the mates of
+  TEpair reads found there.  A read hits a TE if its start or stop
+  is within one, so TEs are padded on the left by p.INSERTSIZE,
+  which is taken to be longer than any alignment.
+  The reads kept are the same as for a scan of the whole file.
+*/
+void scan_bamfile_indexed(const teclust_params & p,
+			  const bamreader & reader,
+			  const refIDlookup & lookup,
+			  const nameset & readPairs,
+			  vector<vector< puu > > * data)
+{
+  bam_index index(p.bamfile.c_str());
+  if( !index )
+    {
+      cerr << "Error: --bamindex requires an index (.bai file) for "
+	   << p.bamfile << '\n';
+      exit(1);
+    }
+
+  //1. Reads hitting TEs, and where their mates are
+  nameset TEpairs;
+  vector<bam_regions> mates(lookup.tes.size());
+  for( int32_t refid = 0 ; unsigned(refid) < lookup.tes.size() ; ++refid )
+    {
+      if( lookup.tes[refid] == nullptr ) continue;
+      bam_regions tes;
+      for( const auto & t : *lookup.tes[refid] )
+	{
+	  tes.emplace_back( max(0,t.start()-p.INSERTSIZE), t.stop()+1 );
+	}
+      merge_regions(tes);
+      for( const auto & t : tes )
+	{
+	  fetch_region(reader,index,refid,t.first,t.second,[&](bamrecord & b) {
+	      string n;
+	      readTEs r;
+	      if( classify(b,lookup,readPairs,&n,&r) && r.TEpair )
 		{
-		  bool hitsTE = find_if( CHROM->second.cbegin(),
-					 CHROM->second.cend(),
-					 [&](const teinfo & __t) {
-					   bool A = (start >= __t.start() && start <= __t.stop());
-					   bool B = (stop >= __t.start() && stop <= __t.stop());
-					   return A||B;
-					 }) != CHROM->second.cend();
-		  if( hitsTE )
+		  if( b.next_refid() < 0 || unsigned(b.next_refid()) >= lookup.ids.size() )
 		    {
-		      /*We can do a check here:
-			If mate is mapped to same chromo & hits a TE,
-			we can skip storing it.
-			We don't have access to it's mates start and stop,
-			but we can check the start.
-		      */
-		      bool OK = true;
-		      if(b.refid() == b.next_refid())
-			{
-			  int32_t mstart = b.next_pos();
-			  OK = find_if( CHROM->second.cbegin(),
-					CHROM->second.cend(),
-					[&](const teinfo & __t) {
-					  return (mstart >= __t.start() && mstart <= __t.stop());
-					}) == CHROM->second.cend();
-			}
-		      if(OK)
-			{
-			  //readPairs->insert( n );
-			  RPlocal.insert(n);
-			}
+		      cerr << "Error: reference ID " << b.next_refid()
+			   << " not found in BAM file header. Line "
+			   << __LINE__ 
+			   << " of " << __FILE__ << '\n';
+		      exit(1);
 		    }
+		  TEpairs.insert(n.data(),r.namelen);
+		  //Only mates on chromosomes with TEs can be kept
+		  if( lookup.tes[b.next_refid()] != nullptr ) mates[b.next_refid()].emplace_back(b.next_pos(),b.next_pos()+1);
 		}
-	    }
+	      return true;
+	    });
 	}
     }
 
-  //Second pass
-  reader.seek( firstREC, SEEK_SET );
-  while(! reader.eof() && !reader.error() )
+  //2. The mates.  Every candidate read of a TEpair is kept, as in a scan of the whole file.
+  for( int32_t refid = 0 ; unsigned(refid) < mates.size() ; ++refid )
     {
-      bamrecord b = reader.next_record();
-      if(b.empty()) break;
-      samflag f(b.flag());
-      if( !f.query_unmapped && !f.mate_unmapped) 
-	//then both reads are mapped 
+      merge_regions(mates[refid]);
+      for( const auto & m : mates[refid] )
 	{
-	  auto itr = lookup.find(b.refid());
-	  if(itr == lookup.end())
-	    {
-	      cerr << "Error: reference ID " << b.refid()
-		   << " not found in BAM file header. Line "
-		   << __LINE__ 
-		   << " of " << __FILE__ << '\n';
-	      exit(1);
-	    }
-	  auto n = editRname(b.read_name());
-	  /*
-	    Note: Julie's script does not check that these reads map uniquely.
-	  */
-	  //if( readPairs->find(n) != readPairs->end() )
-	  if( RPlocal.find(n) != RPlocal.end() && readPairs->find(n) == readPairs->end() )
-	    {
-	      int32_t start = b.pos(),stop= b.pos() + alignment_length(b) - 1;
-	      auto CHROM = refTEs.find(itr->second);
-	      if( CHROM != refTEs.end() )
+	  fetch_region(reader,index,refid,m.first,m.second,[&](bamrecord & b) {
+	      string n;
+	      readTEs r;
+	      if( classify(b,lookup,readPairs,&n,&r) && r.candidate &&
+		  TEpairs.contains(n.data(),r.namelen) )
 		{
-		  bool hitsTE = find_if( CHROM->second.cbegin(),
-					 CHROM->second.cend(),
-					 [&](const teinfo & __t) {
-					   bool A = (start >= __t.start() && start <= __t.stop());
-					   bool B = (stop >= __t.start() && stop <= __t.stop());
-					   return A||B;
-					 }) != CHROM->second.cend();
-		  if(!hitsTE)
-		    {
-		      auto DCHROM = data->find(itr->second);
-		      if(DCHROM == data->end())
-			{
-			  data->insert( make_pair(itr->second,
-						  vector<pair<int32_t,int8_t> >(1,make_pair(start,f.qstrand) ) ) );
-			}
-		      else
-			{
-			  DCHROM->second.emplace_back(make_pair(start,f.qstrand));
-			}
-		    }
+		  if( unsigned(r.id) >= data->size() ) data->resize(r.id+1);
+		  (*data)[r.id].emplace_back(make_pair(r.start,r.strand));
 		}
-	    }
+	      return true;
+	    });
 	}
     }
 }
 
 refIDlookup
-make_lookup(const bamreader & reader)
+make_lookup(const bamreader & reader,
+	    const refTEcont & refTEs,
+	    chromdict * chroms)
 {
   refIDlookup rv;
-  unsigned I=0;
   for_each(reader.ref_cbegin(),reader.ref_cend(),
 	   [&](const pair<string,int32_t> & __p)
 	   {
-	     rv[I++]=__p.first;
+	     rv.ids.push_back(chroms->id(__p.first));
+	     auto __t = refTEs.find(__p.first);
+	     rv.tes.push_back( (__t == refTEs.end()) ? nullptr : &__t->second );
 	   });
   return rv;
 }
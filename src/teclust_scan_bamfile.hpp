@@ -2,18 +2,19 @@
 #define __TECLUST_SCAN_BAMFILE_HPP__
 
 #include <teclust_objects.hpp>
-#include <unordered_set>
+#include <teindex.hpp>
+#include <chromdict.hpp>
+#include <nameset.hpp>
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 #include <cstdint>
 
-using refTEcont = std::map<std::string,std::vector<teinfo> >;
-
 void scan_bamfile(const teclust_params & p,
 		  const refTEcont & refTEs,
-		  std::unordered_set<std::string> * readPairs,
-		  std::map<std::string,std::vector< std::pair<std::int32_t,std::int8_t> > > * data);
+		  const nameset * readPairs,
+		  std::vector<std::vector< std::pair<std::int32_t,std::int8_t> > > * data,
+		  chromdict * chroms);
 
 #endif
@@ -0,0 +1,251 @@
+#include <teindex.hpp>
+#include <file_common.hpp>
+#include <Sequence/IOhelp.hpp>
+#include <zlib.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace Sequence;
+
+/*
+  Layout of the index, in native byte order.  Offsets are from the start of the file.
+
+  header:     char magic[8], uint32_t byteorder, uint32_t nchroms, uint64_t nTEs
+  dictionary: nchroms x {uint64_t first, n, name_offset, name_length}, in order of name.
+              A chromosome's TEs are first..first+n-1.  name_offset is from the start of names.
+  TEs:        nTEs x {int32_t start, stop}, 0-offset and sorted by start within each chromosome
+  maxstop:    nTEs x int32_t, the running maximum of stop within each chromosome
+  names:      the chromosome names, not null-terminated
+
+  Every section starts at a multiple of its alignment, so the TEs
+  and maxstop are used directly from the mapped file.
+*/
+namespace
+{
+  const char teindex_magic[8] = {'P','E','C','N','V','T','E','1'};
+  const uint32_t teindex_byteorder = 0x01020304;
+
+  struct teindex_header
+  {
+    char magic[8];
+    uint32_t byteorder,nchroms;
+    uint64_t nTEs;
+  };
+
+  struct teindex_chrom
+  {
+    uint64_t first,n,name_offset,name_length;
+  };
+
+  static_assert( sizeof(teindex_header) == 24 && sizeof(teindex_chrom) == 32,
+		 "unexpected padding in TE index records" );
+  static_assert( sizeof(teinfo) == 2*sizeof(int32_t),
+		 "teinfo must be two int32_t to be read from a TE index" );
+
+  void invalid_teindex( const char * filename, const char * why )
+  {
+    cerr << "Error: " << filename << " is not a valid TE index ("
+	 << why << "). Remake it with pecnv teindex\n";
+    exit(1);
+  }
+}
+
+refTEcont::refTEcont() : chroms(),tes(),maxstop(),mapping()
+{
+}
+
+refTEcont::const_iterator refTEcont::find( const string & chrom ) const { return chroms.find(chrom); }
+refTEcont::const_iterator refTEcont::begin() const { return chroms.cbegin(); }
+refTEcont::const_iterator refTEcont::end() const { return chroms.cend(); }
+bool refTEcont::empty() const { return chroms.empty(); }
+
+bool is_teindex( const char * filename )
+{
+  FILE * f = fopen(filename,"rb");
+  if( f == NULL ) return false;
+  char magic[8];
+  const bool rv = fread(magic,1,8,f) == 8 && memcmp(magic,teindex_magic,8) == 0;
+  fclose(f);
+  return rv;
+}
+
+refTEcont read_te_bed( const char * filename )
+{
+  gzFile in = gzopen(filename,"r");
+  if(in == NULL )
+    {
+      cerr << "Error: could not open " 
+	   << filename
+	   << " for reading\n";
+      exit(0);
+    }
+
+  map<string,vector<teinfo> > bychrom;
+  do
+    {
+      auto line = IOhelp::gzreadline(in);
+      if(!line.second) break;
+      istringstream instream(line.first);
+      string chrom;
+      unsigned start,stop;
+      instream >> chrom >> start >> stop >> ws;
+      //The input file is BED, so start is 0 offset,
+      //and stop is 1 offset.  Thus, we 
+      //subtract 1 from stop to make both 0 offset
+      bychrom[chrom].emplace_back( teinfo(start,stop-1) );
+    }
+  while(!gzeof(in));
+
+  gzclose(in);
+
+  //Put all TEs in one array, in order of chromosome name, and sort and index each chromosome's
+  refTEcont rv;
+  size_t nTEs = 0;
+  for( const auto & c : bychrom ) nTEs += c.second.size();
+  rv.tes.reserve(nTEs);
+  rv.maxstop.resize(nTEs);
+  for( auto & c : bychrom )
+    {
+      const size_t first = rv.tes.size(), n = c.second.size();
+      rv.tes.insert(rv.tes.end(),c.second.begin(),c.second.end());
+      vector<teinfo>().swap(c.second);
+      teintervals::build(&rv.tes[first],&rv.maxstop[first],n);
+      rv.chroms[c.first] = teintervals(&rv.tes[first],&rv.maxstop[first],n);
+    }
+  return rv;
+}
+
+refTEcont map_teindex( const char * filename )
+{
+  int fd = open(filename,O_RDONLY);
+  if( fd == -1 )
+    {
+      cerr << "Error: could not open " 
+	   << filename
+	   << " for reading\n";
+      exit(1);
+    }
+  struct stat buf;
+  if( fstat(fd,&buf) == -1 )
+    {
+      cerr << "Error: could not stat " << filename << '\n';
+      exit(1);
+    }
+  const size_t size = size_t(buf.st_size);
+  if( size < sizeof(teindex_header) )
+    {
+      close(fd);
+      invalid_teindex(filename,"too short");
+    }
+  void * p = mmap(nullptr,size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if( p == MAP_FAILED )
+    {
+      cerr << "Error: could not map " << filename
+	   << " into memory: " << strerror(errno) << '\n';
+      exit(1);
+    }
+  refTEcont rv;
+  rv.mapping = shared_ptr<const char>(static_cast<const char *>(p),
+				      [size](const char * __p) { munmap(const_cast<char *>(__p),size); });
+  const char * base = rv.mapping.get();
+
+  teindex_header h;
+  memcpy(&h,base,sizeof(h));
+  if( memcmp(h.magic,teindex_magic,8) ) invalid_teindex(filename,"bad magic number");
+  if( h.byteorder != teindex_byteorder ) invalid_teindex(filename,"made on a machine with a different byte order");
+  //Check the sizes before computing offsets from them
+  const uint64_t avail = size - sizeof(h);
+  if( h.nchroms > avail / sizeof(teindex_chrom) ||
+      h.nTEs > (avail - h.nchroms*sizeof(teindex_chrom)) / (sizeof(teinfo) + sizeof(int32_t)) )
+    {
+      invalid_teindex(filename,"truncated");
+    }
+  const size_t dict = sizeof(h),
+    tesoff = dict + h.nchroms*sizeof(teindex_chrom),
+    maxoff = tesoff + h.nTEs*sizeof(teinfo),
+    namesoff = maxoff + h.nTEs*sizeof(int32_t);
+  const teinfo * tes = reinterpret_cast<const teinfo *>(base + tesoff);
+  const int32_t * maxstop = reinterpret_cast<const int32_t *>(base + maxoff);
+  for( uint32_t i = 0 ; i < h.nchroms ; ++i )
+    {
+      teindex_chrom c;
+      memcpy(&c,base + dict + i*sizeof(c),sizeof(c));
+      if( c.first > h.nTEs || c.n > h.nTEs - c.first ||
+	  c.name_offset > size - namesoff || c.name_length > size - namesoff - c.name_offset )
+	{
+	  invalid_teindex(filename,"truncated");
+	}
+      rv.chroms[string(base + namesoff + c.name_offset,c.name_length)] = teintervals(tes + c.first,maxstop + c.first,c.n);
+    }
+  return rv;
+}
+
+bool write_teindex( const refTEcont & TEs, const char * filename )
+{
+  ofstream out(filename,ios::out|ios::binary|ios::trunc);
+  if(!out) return false;
+  teindex_header h;
+  memcpy(h.magic,teindex_magic,8);
+  h.byteorder = teindex_byteorder;
+  h.nchroms = uint32_t(TEs.chroms.size());
+  h.nTEs = 0;
+  for( const auto & c : TEs ) h.nTEs += c.second.n;
+  out.write(reinterpret_cast<const char *>(&h),sizeof(h));
+  uint64_t first = 0, name_offset = 0;
+  for( const auto & c : TEs )
+    {
+      const teindex_chrom d = {first,c.second.n,name_offset,c.first.size()};
+      out.write(reinterpret_cast<const char *>(&d),sizeof(d));
+      first += c.second.n;
+      name_offset += c.first.size();
+    }
+  for( const auto & c : TEs )
+    {
+      out.write(reinterpret_cast<const char *>(c.second.tes),streamsize(c.second.n*sizeof(teinfo)));
+    }
+  for( const auto & c : TEs )
+    {
+      out.write(reinterpret_cast<const char *>(c.second.maxstop),streamsize(c.second.n*sizeof(int32_t)));
+    }
+  for( const auto & c : TEs ) out.write(c.first.data(),streamsize(c.first.size()));
+  out.close();
+  return !out.fail();
+}
+
+int teindex_main( int argc, char ** argv )
+{
+  if( argc != 3 )
+    {
+      cerr << "Usage: pecnv teindex tefile outfile\n"
+	   << "Makes an index of the TE positions in tefile (BED format, may be gzipped),\n"
+	   << "which may be passed to pecnv teclust --tepos/-t in place of tefile.\n";
+      exit(0);
+    }
+  if( !file_exists(argv[1]) )
+    {
+      cerr << "Error: " << argv[1] << " does not exist\n";
+      exit(1);
+    }
+  if( is_teindex(argv[1]) )
+    {
+      cerr << "Error: " << argv[1] << " is already a TE index\n";
+      exit(1);
+    }
+  const refTEcont TEs = read_te_bed(argv[1]);
+  if( !write_teindex(TEs,argv[2]) )
+    {
+      cerr << "Error: could not write " << argv[2] << '\n';
+      exit(1);
+    }
+  return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __PECNV_TEINDEX_HPP__
+#define __PECNV_TEINDEX_HPP__
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <teclust_objects.hpp>
+
+struct refTEcont
+/*
+  The reference TEs used by teclust, by chromosome.  They come either
+  from a BED file, which is parsed and indexed, or from the binary index
+  written by pecnv teindex, which is mapped into memory and used in place.
+  Loading an index only reads its chromosome dictionary, and jobs on one
+  machine that use the same index share its pages.
+  The teintervals point into tes/maxstop or into the mapping, so a
+  refTEcont may be moved, but not copied.
+*/
+{
+  using const_iterator = std::map<std::string,teintervals>::const_iterator;
+  std::map<std::string,teintervals> chroms;
+  //The TEs, when read from a BED file
+  std::vector<teinfo> tes;
+  std::vector<std::int32_t> maxstop;
+  //The index file, when mapped
+  std::shared_ptr<const char> mapping;
+  refTEcont();
+  refTEcont( refTEcont && ) = default;
+  refTEcont & operator=( refTEcont && ) = default;
+  refTEcont( const refTEcont & ) = delete;
+  refTEcont & operator=( const refTEcont & ) = delete;
+  const_iterator find( const std::string & chrom ) const;
+  const_iterator begin() const;
+  const_iterator end() const;
+  bool empty() const;
+};
+
+//Is filename an index written by pecnv teindex?
+bool is_teindex( const char * filename );
+
+//Read TEs from a BED file, gzipped or not.  Exits with an error message if it cannot be opened.
+refTEcont read_te_bed( const char * filename );
+
+//Map an index written by write_teindex.  Exits with an error message if it cannot be mapped or is not valid.
+refTEcont map_teindex( const char * filename );
+
+//Write the index of TEs to filename.  Returns false on error.
+bool write_teindex( const refTEcont & TEs, const char * filename );
+
+int teindex_main( int argc, char ** argv );
+
+#endif
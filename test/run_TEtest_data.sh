@@ -54,13 +54,13 @@ cd TEtestData
 paste <(ls *_1.fastq.gz) <(ls *_2.fastq.gz) > INFILE
 
 ##Run the pecnv pipeline
-pecnv.sh -S line99 -i INFILE -r dmel-all-chromosome-r5.1_simplenames.fasta -c $CPU
+pecnv.sh -S line99 -M -i INFILE -r dmel-all-chromosome-r5.1_simplenames.fasta -c $CPU
 
 ##Get the 99th quantile of the insert size distribution
-u99=`pecnv_insert_qtile pecnv_output/pecnv_bamfile.mdist.gz 0.99`
+u99=`pecnv qtile pecnv_output/pecnv_bamfile.mdist.gz 0.99`
 
 ##Run teclust
-pecnv teclust -s line99 -b pecnv_output/pecnv_bamfile_sorted.bam -t TE_position_r5.1.bed -o teclust_output.gz -u pecnv_output/pecnv_bamfile.um_u.csv.gz -m pecnv_output/pecnv_bamfile.um_m.csv.gz -i $u99 -p phrapdir
+pecnv teclust -s line99 -b pecnv_output/pecnv_bamfile_sorted.bam --bamindex -t TE_position_r5.1.bed -o teclust_output.gz -u pecnv_output/pecnv_bamfile.um_u.csv.gz -m pecnv_output/pecnv_bamfile.um_m.csv.gz -i $u99 -p phrapdir
 
 ##If we have the right stuff on the system, assemble in parallel using phrap
 CANASSEMBLE=1